@@ -0,0 +1,88 @@
+/*  =========================================================================
+    fty_ambient_location_clock - Wall clock of the calculation, real or simulated
+
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+#ifndef FTY_AMBIENT_LOCATION_CLOCK_H_INCLUDED
+#define FTY_AMBIENT_LOCATION_CLOCK_H_INCLUDED
+
+#ifdef __cplusplus
+#include <atomic>
+#include <cstdint>
+#include <ctime>
+
+//  Time as seen by the server: the wall clock comparing sensor timestamps,
+//  a monotonic clock for internal delays and the calculation period.
+//  Shared by the stream and calculation actors.
+class AmbientClock{
+  public :
+    virtual ~AmbientClock () {}
+    //  Wall clock, in seconds
+    virtual time_t now () const = 0;
+    //  Wall clock, in milliseconds
+    virtual int64_t now_ms () const = 0;
+    //  Monotonic clock, in milliseconds
+    virtual int64_t mono () const = 0;
+    //  Seconds between two calculations
+    virtual int polling_interval () const = 0;
+};
+
+//  std::time, zclock_mono and the fty-shm polling interval
+class AmbientSystemClock : public AmbientClock{
+  public :
+    time_t now () const override;
+    int64_t now_ms () const override;
+    int64_t mono () const override;
+    int polling_interval () const override;
+};
+
+//  Virtual time, which only moves when told to. The calculation is then
+//  driven tick by tick (SIMULATE command of the server).
+class AmbientVirtualClock : public AmbientClock{
+  public :
+    AmbientVirtualClock (time_t start, int interval);
+    time_t now () const override { return m_now; }
+    int64_t now_ms () const override { return int64_t (m_now) * 1000; }
+    int64_t mono () const override { return int64_t (m_now - m_start) * 1000; }
+    int polling_interval () const override { return m_interval; }
+
+    //  Move the clock forward, never backward; return the new time
+    time_t advance (int seconds);
+    time_t set (time_t now);
+
+  private :
+    const time_t m_start;
+    const int m_interval;
+    std::atomic<time_t> m_now;
+};
+
+//  @interface
+//  Self test of this class
+FTY_METRIC_AMBIENT_LOCATION_EXPORT void
+    fty_ambient_location_clock_test (bool verbose);
+
+//  @end
+extern "C" {
+#endif
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,74 @@
+/*  =========================================================================
+    fty_ambient_location_histogram - Log-linear latency histogram
+
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+#ifndef FTY_AMBIENT_LOCATION_HISTOGRAM_H_INCLUDED
+#define FTY_AMBIENT_LOCATION_HISTOGRAM_H_INCLUDED
+
+#ifdef __cplusplus
+#include <atomic>
+#include <cstdint>
+
+//  Histogram of values up to 2^40 with a relative error of at most 1/64
+//  (about 1.6%), in the way of HdrHistogram: 64 linear sub-buckets per power of two. Recording
+//  is a few shifts and one relaxed atomic increment, by a single writer;
+//  any thread may read.
+class AmbientHistogram{
+  public :
+    AmbientHistogram ();
+    void record (uint64_t value);
+    uint64_t count () const { return m_count.load (std::memory_order_relaxed); }
+    uint64_t max () const { return m_max.load (std::memory_order_relaxed); }
+    //  Highest value equivalent to the one at percentile (0-100), 0 if empty
+    uint64_t percentile (double percentile) const;
+
+    //  Append name.count, name.p50, name.p99, name.p999 and name.max name
+    //  and value frames to message
+    void append (zmsg_t *message, const char *name) const;
+
+  private :
+    static const int SUB_BITS = 7;
+    static const int SUB = 1 << SUB_BITS;
+    static const int HALF = SUB / 2;
+    static const int MAX_BITS = 40;
+    static const int BUCKETS = SUB + (MAX_BITS - SUB_BITS) * HALF;
+
+    static int index (uint64_t value);
+    static uint64_t highest (int index);
+
+    std::atomic<uint64_t> m_counts[BUCKETS];
+    std::atomic<uint64_t> m_count;
+    std::atomic<uint64_t> m_max;
+};
+
+//  @interface
+//  Self test of this class
+FTY_METRIC_AMBIENT_LOCATION_EXPORT void
+    fty_ambient_location_histogram_test (bool verbose);
+
+//  @end
+extern "C" {
+#endif
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,73 @@
+/*  =========================================================================
+    fty_ambient_location_metric - In place decoding of sensor metric messages
+
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+#ifndef FTY_AMBIENT_LOCATION_METRIC_H_INCLUDED
+#define FTY_AMBIENT_LOCATION_METRIC_H_INCLUDED
+
+#ifdef __cplusplus
+#include <cstdint>
+#include <string>
+
+//  Fields of an FTY_PROTO_METRIC message the server uses, read straight
+//  from its frame: no fty_proto_t, no aux hash. Strings are copied into
+//  buffers reused from one message to the next, so decoding does not
+//  allocate once they grew.
+class AmbientMetric{
+  public :
+    AmbientMetric ();
+    //  Decode message, which is left untouched. Return 0 if it is a single
+    //  frame FTY_PROTO_METRIC, -1 otherwise: the message must then go
+    //  through fty_proto_decode.
+    int decode (zmsg_t *message);
+
+    //  aux/sname, "" if missing
+    const std::string &sname () const { return m_sname; }
+    const std::string &type () const { return m_type; }
+    const std::string &name () const { return m_name; }
+    const std::string &value () const { return m_value; }
+    const std::string &unit () const { return m_unit; }
+    uint32_t ttl () const { return m_ttl; }
+    uint64_t time () const { return m_time; }
+
+  private :
+    std::string m_sname;
+    std::string m_type;
+    std::string m_name;
+    std::string m_value;
+    std::string m_unit;
+    uint32_t m_ttl;
+    uint64_t m_time;
+};
+
+//  @interface
+//  Self test of this class
+FTY_METRIC_AMBIENT_LOCATION_EXPORT void
+    fty_ambient_location_metric_test (bool verbose);
+
+//  @end
+extern "C" {
+#endif
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,82 @@
+/*  =========================================================================
+    fty_ambient_location_pool - Work stealing pool computing independent subtrees
+
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+#ifndef FTY_AMBIENT_LOCATION_POOL_H_INCLUDED
+#define FTY_AMBIENT_LOCATION_POOL_H_INCLUDED
+
+#ifdef __cplusplus
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+//  Fixed set of threads running batches of independent tasks. Each thread
+//  has its own queue and steals from the others once it is empty, so a few
+//  large tasks do not leave the other threads idle.
+class AmbientWorkerPool{
+  public :
+    //  Start threads - 1 workers, the caller of run being the last one
+    explicit AmbientWorkerPool (size_t threads);
+    ~AmbientWorkerPool ();
+    size_t size () const { return m_queues.size (); }
+
+    //  Call task (i) for each i in [0, count), return once all are done
+    void run (size_t count, const std::function<void (size_t)> &task);
+
+  private :
+    struct queue_t {
+      std::mutex mutex;
+      std::deque<size_t> tasks;
+      uint64_t generation = 0;
+    };
+    //  Take a task of batch generation, own queue first
+    bool pop (size_t worker, uint64_t generation, size_t &index);
+    void work (size_t worker, uint64_t generation, const std::function<void (size_t)> &task);
+    void worker_main (size_t worker);
+
+    std::vector<std::unique_ptr<queue_t>> m_queues;
+    std::vector<std::thread> m_threads;
+    std::mutex m_mutex;
+    std::condition_variable m_wake;
+    std::condition_variable m_done;
+    const std::function<void (size_t)> *m_task;
+    uint64_t m_generation;
+    size_t m_pending;
+    bool m_stop;
+};
+
+//  @interface
+//  Self test of this class
+FTY_METRIC_AMBIENT_LOCATION_EXPORT void
+    fty_ambient_location_pool_test (bool verbose);
+
+//  @end
+extern "C" {
+#endif
+#ifdef __cplusplus
+}
+#endif
+
+#endif
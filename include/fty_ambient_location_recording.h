@@ -0,0 +1,86 @@
+/*  =========================================================================
+    fty_ambient_location_recording - Length-prefixed recording of stream messages
+
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+#ifndef FTY_AMBIENT_LOCATION_RECORDING_H_INCLUDED
+#define FTY_AMBIENT_LOCATION_RECORDING_H_INCLUDED
+
+#ifdef __cplusplus
+#include <cstdint>
+#include <cstdio>
+#include <string>
+
+//  File of stream messages, each one with the stream it came from and the
+//  time it was received. After an 8 bytes magic, records are
+//      uint32 size of what follows
+//      int64  time, in milliseconds since the epoch
+//      uint8  size of the stream name, stream name
+//      frames: uint32 size, data
+//  with all integers little endian.
+class AmbientRecorder{
+  public :
+    AmbientRecorder ();
+    ~AmbientRecorder ();
+    //  Create (truncate) the file, return 0 on success
+    int open (const char *path);
+    //  Append a message, which is left untouched; return 0 on success
+    int write (int64_t time, const char *stream, zmsg_t *message);
+    void close ();
+    bool is_open () const { return m_file != NULL; }
+    uint64_t records () const { return m_records; }
+
+  private :
+    FILE *m_file;
+    uint64_t m_records;
+    std::string m_buffer;
+};
+
+//  Reads back what an AmbientRecorder wrote
+class AmbientRecording{
+  public :
+    AmbientRecording ();
+    ~AmbientRecording ();
+    //  Return 0 if the file is a recording
+    int open (const char *path);
+    //  Read the next record, the caller owns message. Return 1 if a record
+    //  was read, 0 at the end of the file, -1 if the file is corrupted or
+    //  truncated.
+    int read (int64_t &time, std::string &stream, zmsg_t **message);
+    void close ();
+
+  private :
+    FILE *m_file;
+    std::string m_buffer;
+};
+
+//  @interface
+//  Self test of this class
+FTY_METRIC_AMBIENT_LOCATION_EXPORT void
+    fty_ambient_location_recording_test (bool verbose);
+
+//  @end
+extern "C" {
+#endif
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -23,23 +23,295 @@
 #define FTY_AMBIENT_LOCATION_SERVER_H_INCLUDED
 
 #ifdef __cplusplus
+#include <atomic>
+#include <memory>
+
+struct ambient_value_t {
+  double value;
+  int ttl;
+};
+
+struct ambient_values_t {
+  ambient_value_t in_temperature;
+  ambient_value_t in_humidity;
+  ambient_value_t out_temperature;
+  ambient_value_t out_humidity;
+};
+
+//  Kind of a location, from its asset type, deciding what is published
+enum ambient_location_kind_t {
+  AMBIENT_LOCATION_KIND_OTHER,
+  AMBIENT_LOCATION_KIND_ROW,
+  AMBIENT_LOCATION_KIND_RACK
+};
+
+//  Averages published for a location
+enum ambient_output_t {
+  AMBIENT_OUTPUT_TEMPERATURE_INPUT,
+  AMBIENT_OUTPUT_HUMIDITY_INPUT,
+  AMBIENT_OUTPUT_TEMPERATURE_OUTPUT,
+  AMBIENT_OUTPUT_HUMIDITY_OUTPUT,
+  AMBIENT_OUTPUT_TEMPERATURE,
+  AMBIENT_OUTPUT_HUMIDITY,
+  AMBIENT_OUTPUT_COUNT
+};
+
+//  Last value written in shared memory for an average
+struct ambient_published_t {
+  double value = 0;
+  time_t time = 0;
+};
+
+//  Last computed values of a location. The node is recomputed only when
+//  it is dirty: one of its descendants changed, one of the sensor values
+//  behind it expired or one of its averages must be refreshed (refresh_at).
+struct ambient_location_node_t {
+  ambient_values_t result;
+  time_t refresh_at = 0;
+  //  deadline of the pending refresh timer, 0 if none
+  time_t scheduled = 0;
+  //  oldest ingest (clock mono, ms) of the sensor values behind it which
+  //  were not computed yet, 0 if none
+  int64_t ingested = 0;
+  bool dirty = true;
+  ambient_published_t published[AMBIENT_OUTPUT_COUNT];
+};
+
+//  Average computed during a calculation, written at the end of it
+struct ambient_publication_t {
+  asset_id_t id;
+  ambient_output_t output;
+  double value;
+  int ttl;
+  //  ingested of the location when it was computed
+  int64_t ingested;
+};
+
+//  Averages queued by a computation, one per subtree computed in parallel,
+//  merged in the order of a serial computation
+struct ambient_compute_t {
+  std::vector<ambient_publication_t> publications;
+  uint64_t suppressed = 0;
+  std::vector<asset_id_t> recomputed;
+};
+
+struct ambient_publish_stats_t {
+  uint64_t written = 0;
+  uint64_t suppressed = 0;
+  uint64_t failed = 0;
+};
+
+enum ambient_function_t {
+  AMBIENT_FUNCTION_NONE,
+  AMBIENT_FUNCTION_INPUT,
+  AMBIENT_FUNCTION_OUTPUT
+};
+
+//  Last value received for one metric of a sensor, parsed at ingest
+struct ambient_slot_t {
+  double value;
+  time_t valid_till;
+  uint32_t ttl;
+  bool valid;
+  //  deadline of the pending expiry timer, 0 if none (calculation side)
+  time_t scheduled;
+};
+
+//  Last metrics received from a sensor
+struct ambient_sensor_t {
+  ambient_slot_t humidity;
+  ambient_slot_t temperature;
+};
+
+//  Sensor metric received since the last calculation
+struct ambient_sensor_update_t {
+  asset_id_t id;
+  int type;
+  ambient_slot_t slot;
+  //  clock mono, ms
+  int64_t ingested;
+};
+
+//  Last value read in shm for one metric of a sensor
+struct ambient_shm_seen_t {
+  uint64_t time;
+  std::string value;
+};
+
+//  What the asset messages told us about an asset
+struct ambient_asset_t {
+  bool sensor;
+  ambient_function_t function;
+  ambient_location_kind_t kind;
+};
+
+//  Immutable version of the topology, built by the stream actor and handed
+//  to the calculation through an atomic pointer swap. A version is freed
+//  once neither the stream actor nor the calculation hold it anymore.
+struct ambient_topology_version_t {
+  uint64_t version;
+  AmbientHierarchy hierarchy;
+  std::vector<ambient_asset_t> assets;    // indexed by asset id
+  //  assets whose ancestors must be recomputed, since the last version
+  //  the calculation is known to have seen
+  std::vector<asset_id_t> changes;
+};
+
+//  Change of the topology, with the first version carrying it (0 if none yet)
+struct ambient_topology_change_t {
+  asset_id_t id;
+  uint64_t version;
+};
+
+//  Client consuming some of the streams. The stream actor serves its lanes
+//  in turn, at most batch messages each, so a lane never waits for more
+//  than a batch of each other one.
+struct ambient_lane_t {
+  mlm_client_t *client;
+  int batch;
+  ambient_stat_t backlog;
+  ambient_stat_t backlog_max;
+  ambient_stat_t yields;
+};
+
 class AmbientLocation{
   public :
     AmbientLocation ();
     ~AmbientLocation();
     int timeout_ms;
+    //  assets, mailbox and REPUBLISH request
     mlm_client_t *client;
+    //  sensor metrics, so they never queue behind an asset burst
+    mlm_client_t *metrics_client;
     zactor_t *ambient_calculation;
-    std::unordered_map <std::string, std::string> containers;
-    std::unordered_map <std::string, std::vector<std::string>> m_list_contents;
-    std::unordered_map <std::string, std::pair<std::string, std::pair<fty_proto_t*, fty_proto_t*>>> cache;
-    std::vector<std::string> datacenters;   
+
+    //  Ingest side, only used by the stream actor. Topology changes are
+    //  compiled into a new version once the asset messages settle.
+    AmbientTopology topology;
+    std::vector<ambient_asset_t> assets;    // indexed by asset id
+    //  sensor metrics are decoded there, its buffers reused
+    AmbientMetric metric;
+    //  sensor values of the batch of messages being received, the latest
+    //  one per sensor and type, with their unit; pending_index holds the
+    //  position + 1 in pending of id * 2 + type, 0 if none
+    std::vector<ambient_sensor_update_t> pending;
+    std::vector<std::string> pending_units;
+    std::vector<uint32_t> pending_index;
+    bool topology_changed;
+    int64_t topology_changed_since;
+    uint64_t topology_version;
+    std::vector<ambient_topology_change_t> changes;
+    //  startup: the answer to REPUBLISH is loaded before the first version
+    //  is published and the calculation starts (clock mono, ms)
+    bool bulk_loading;
+    int64_t bulk_load_started;
+    int64_t bulk_load_last;
+    //  topology file (store/topology), saved with each version and loaded
+    //  at START; the assets loaded are removed at the end of the startup
+    //  load unless the answer to REPUBLISH confirmed them
+    std::string topology_path;
+    std::vector<bool> topology_confirmed;
+    //  values file (store/values), loaded when the calculation starts
+    std::string values_path;
+    //  when CONSUMER asks for all the sensor metrics and subscription/narrow
+    //  is set, only those of the devices the known sensors are plugged into
+    //  are consumed, or of any device while one of them has none. Updated
+    //  from the server loop after each topology version (subscription_changed)
+    bool narrow;
+    bool metrics_consumer;
+    bool subscription_changed;
+    std::string endpoint;
+    std::string metrics_name;
+    std::vector<std::string> sensor_devices;    // indexed by asset id, "" if unknown
+    bool subscribed_all;
+    std::vector<std::string> subscribed_devices;    // sorted
+    //  sensor metrics read in shm instead of the stream (ingest/backend shm)
+    //  every ingest_interval_ms of real time like the stream, even in
+    //  simulation where TICK reads them too (zclock_mono, ms). Only those
+    //  which changed since the last read are ingested; shm_seen is indexed
+    //  by id * 2 + type
+    bool ingest_shm;
+    int ingest_interval_ms;
+    int64_t ingest_next;
+    std::vector<ambient_shm_seen_t> shm_seen;
+
+    //  Shared by both actors: latest topology version, only accessed through
+    //  std::atomic_load/std::atomic_store, the last version the calculation
+    //  loaded, and sensor metrics received since the last calculation,
+    //  guarded by mtx_ambient_hashmap
+    std::shared_ptr<const ambient_topology_version_t> topology_published;
+    std::atomic<uint64_t> topology_consumed;
+    std::vector<ambient_sensor_update_t> updates;
+    //  event-driven mode (calculation/debounce): the stream actor sends
+    //  UPDATE to the calculation when updates stops being empty, and keeps
+    //  the time of the last one (clock mono, ms)
+    std::atomic<int64_t> updates_last;
+    //  report each calculation on the actor pipe (MONITOR command)
+    std::atomic<bool> monitor;
+    //  reported on STATS requests, shared atomic counters updated by both
+    //  actors
+    AmbientStats stats;
+    //  ms from the time of a sensor metric to its ingest (stream actor),
+    //  and from ingest to the publication of each average it changed
+    //  (calculation actor)
+    AmbientHistogram sensor_latency;
+    AmbientHistogram publish_latency;
+    //  time as seen by both actors, virtual in simulation mode where the
+    //  calculation only runs on TICK (SIMULATE command)
+    std::unique_ptr<AmbientClock> clock;
+    AmbientVirtualClock *simulation;
+    //  stream messages consumed are copied there (RECORD command)
+    AmbientRecorder recorder;
+
+    //  Calculation side, only used by the calculation actor
+    std::shared_ptr<const ambient_topology_version_t> snapshot;
+    //  indexed by asset id
+    std::vector<ambient_sensor_t> cache;
+    std::vector<ambient_location_node_t> locations;
+    //  an average is not published again while it moves less than
+    //  deadband, unless refresh percents of its ttl elapsed
+    double deadband;
+    int refresh;
+    //  threads computing the subtrees below datacenters
+    int threads;
+    //  event-driven mode: calculate once sensor updates stop for debounce
+    //  ms, at most max_latency ms after the first one; 0 to calculate every
+    //  polling interval only
+    int debounce_ms;
+    int max_latency_ms;
+    ambient_compute_t computed;
+    std::vector<asset_id_t> tasks;
+    std::vector<ambient_compute_t> tasks_computed;
+    //  expiry of sensor values and refresh of locations
+    AmbientTimingWheel expiry;
+    std::vector<AmbientTimingWheel::expiry_t> expired;
+    ambient_publish_stats_t publish_stats;
+    //  write the statistics in shm after each calculation (stats/publish)
+    bool stats_publish;
+    //  the sensor values are saved every values_interval s, and when the
+    //  calculation stops
+    int values_interval;
+    time_t values_saved;
+};
+
+//  Result of a micro benchmark
+struct ambient_microbench_t {
+  std::string name;
+  uint64_t operations;
+  double ns_per_op;
+  double allocations_per_op;
 };
 
 //  @interface
 FTY_METRIC_AMBIENT_LOCATION_EXPORT void
     ambient_location_calculation (zsock_t *pipe, void *args);
 
+//  Run the micro benchmarks of the server internals, averages are written
+//  in the fty-shm test directory. allocations, if not NULL, is a count of
+//  heap allocations maintained by the caller.
+FTY_METRIC_AMBIENT_LOCATION_EXPORT std::vector<ambient_microbench_t>
+    fty_ambient_location_server_microbench (const std::atomic<uint64_t> *allocations);
+
 //  Self test of this class
 FTY_METRIC_AMBIENT_LOCATION_EXPORT void
     fty_ambient_location_server_test (bool verbose);
@@ -0,0 +1,108 @@
+/*  =========================================================================
+    fty_ambient_location_stats - Runtime counters and gauges of the agent
+
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+#ifndef FTY_AMBIENT_LOCATION_STATS_H_INCLUDED
+#define FTY_AMBIENT_LOCATION_STATS_H_INCLUDED
+
+#ifdef __cplusplus
+#include <atomic>
+#include <cstdint>
+
+//  Statistics of the agent. Counters only grow, gauges hold the last value.
+enum ambient_stat_t {
+  //  stream side
+  AMBIENT_STAT_METRICS_RECEIVED,
+  AMBIENT_STAT_METRICS_IGNORED,     // not temperature/humidity, unknown sensor, not a number
+  AMBIENT_STAT_METRICS_COALESCED,   // replaced by a newer value of the same batch
+  AMBIENT_STAT_STREAM_WAKEUPS,      // rounds of the lanes served
+  AMBIENT_STAT_LANE_METRICS_BACKLOG,     // gauge, messages received in the last batch
+  AMBIENT_STAT_LANE_METRICS_BACKLOG_MAX, // gauge
+  AMBIENT_STAT_LANE_METRICS_YIELDS,      // batches cut with messages left
+  AMBIENT_STAT_LANE_ASSETS_BACKLOG,
+  AMBIENT_STAT_LANE_ASSETS_BACKLOG_MAX,
+  AMBIENT_STAT_LANE_ASSETS_YIELDS,
+  AMBIENT_STAT_SUBSCRIPTION_DEVICES,  // gauge, devices the metrics are consumed from, 0 for all
+  AMBIENT_STAT_SUBSCRIPTION_RESETS,   // metrics client reconnected to narrow its patterns
+  AMBIENT_STAT_INGEST_READS,        // sensor metrics read in shm (ingest/backend shm)
+  AMBIENT_STAT_INGEST_READ_US,      // gauge, last read
+  AMBIENT_STAT_ASSETS_RECEIVED,
+  AMBIENT_STAT_ASSETS_IGNORED,      // devices other than sensors
+  AMBIENT_STAT_MESSAGES_IGNORED,    // not fty_proto, other streams
+  AMBIENT_STAT_CACHE_UPDATES,       // sensor values stored
+  AMBIENT_STAT_LOCK_CONTENDED,      // mtx_ambient_hashmap was held by the other actor
+  AMBIENT_STAT_LOCK_WAIT_US,
+  AMBIENT_STAT_TOPOLOGY_VERSION,    // gauge
+  AMBIENT_STAT_TOPOLOGY_NODES,      // gauge
+  AMBIENT_STAT_TOPOLOGY_SENSORS,    // gauge
+  AMBIENT_STAT_TOPOLOGY_DATACENTERS,// gauge
+  AMBIENT_STAT_STARTUP_ASSETS,      // gauge, asset messages loaded before the calculation started
+  AMBIENT_STAT_STARTUP_MS,          // gauge, time it took
+  AMBIENT_STAT_CACHE_RESTORED,      // gauge, sensor values restored at startup
+  //  calculation side
+  AMBIENT_STAT_CACHE_EXPIRED,       // sensor values expired
+  AMBIENT_STAT_CYCLES,
+  AMBIENT_STAT_EVENT_CYCLES,        // run after sensor updates (calculation/debounce)
+  AMBIENT_STAT_CYCLE_US,            // gauge, last calculation
+  AMBIENT_STAT_CYCLE_MAX_US,        // gauge
+  AMBIENT_STAT_CYCLE_TOTAL_US,
+  //  both
+  AMBIENT_STAT_SHM_WRITES,
+  AMBIENT_STAT_SHM_FAILURES,
+  AMBIENT_STAT_SHM_SUPPRESSED,      // averages not written again (deadband)
+  AMBIENT_STAT_COUNT
+};
+
+//  Lock free, each statistic is a relaxed atomic updated in place by any
+//  actor (a few are updated by both) and read by whoever reports them.
+class AmbientStats{
+  public :
+    AmbientStats ();
+    void add (ambient_stat_t stat, uint64_t count = 1)
+      { m_values[stat].fetch_add (count, std::memory_order_relaxed); }
+    void set (ambient_stat_t stat, uint64_t value)
+      { m_values[stat].store (value, std::memory_order_relaxed); }
+    void raise (ambient_stat_t stat, uint64_t value);
+    uint64_t get (ambient_stat_t stat) const
+      { return m_values[stat].load (std::memory_order_relaxed); }
+
+    //  Name of a statistic, as reported ("metrics.received"...)
+    static const char *name (ambient_stat_t stat);
+    //  Append name and value frames of all statistics to message
+    void append (zmsg_t *message) const;
+
+  private :
+    std::atomic<uint64_t> m_values[AMBIENT_STAT_COUNT];
+};
+
+//  @interface
+//  Self test of this class
+FTY_METRIC_AMBIENT_LOCATION_EXPORT void
+    fty_ambient_location_stats_test (bool verbose);
+
+//  @end
+extern "C" {
+#endif
+#ifdef __cplusplus
+}
+#endif
+
+#endif
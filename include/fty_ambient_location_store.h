@@ -0,0 +1,86 @@
+/*  =========================================================================
+    fty_ambient_location_store - Files keeping the topology and sensor values across restarts
+
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+#ifndef FTY_AMBIENT_LOCATION_STORE_H_INCLUDED
+#define FTY_AMBIENT_LOCATION_STORE_H_INCLUDED
+
+#ifdef __cplusplus
+#include <cstdint>
+#include <string>
+#include <vector>
+
+//  Sensor value kept in a values file
+struct ambient_stored_value_t {
+  std::string name;
+  uint32_t type;
+  double value;
+  int64_t valid_till;
+  uint32_t ttl;
+};
+
+//  Topology file, read through mmap. After an 8 bytes magic:
+//      uint32 assets, uint32 datacenters, uint32 size of the names, uint32 0
+//      per asset: uint32 parent, uint32 name offset, uint32 name size,
+//                 uint32 attributes
+//      per datacenter: uint32 asset id
+//      names, back to back
+//  with all integers little endian. Asset ids are the order of the records,
+//  the attributes are opaque to the store.
+//
+//  Values file, read the same way. After an 8 bytes magic:
+//      uint32 values, uint32 size of the names
+//      per value: uint32 name offset, uint32 name size, uint32 type,
+//                 uint32 ttl, int64 valid till, IEEE 754 double value
+//      names, back to back
+class AmbientStore{
+  public :
+    //  Write topology and the attributes of each of its assets, replacing
+    //  the file only once it is complete. Return 0 on success.
+    static int save_topology (const char *path, const AmbientTopology &topology,
+        const std::vector<uint32_t> &attributes);
+    //  Load the file into topology, which must be empty, and attributes.
+    //  Return 0 on success, -1 if the file is missing or corrupted, in
+    //  which case both are left untouched.
+    static int load_topology (const char *path, AmbientTopology &topology,
+        std::vector<uint32_t> &attributes);
+
+    //  Write values, replacing the file only once it is complete. Return 0
+    //  on success.
+    static int save_values (const char *path, const std::vector<ambient_stored_value_t> &values);
+    //  Replace values by the content of the file. Return 0 on success, -1
+    //  if the file is missing or corrupted, values are then left untouched.
+    static int load_values (const char *path, std::vector<ambient_stored_value_t> &values);
+};
+
+//  @interface
+//  Self test of this class
+FTY_METRIC_AMBIENT_LOCATION_EXPORT void
+    fty_ambient_location_store_test (bool verbose);
+
+//  @end
+extern "C" {
+#endif
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,122 @@
+/*  =========================================================================
+    fty_ambient_location_topology - Interned asset hierarchy of the locations
+
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+#ifndef FTY_AMBIENT_LOCATION_TOPOLOGY_H_INCLUDED
+#define FTY_AMBIENT_LOCATION_TOPOLOGY_H_INCLUDED
+
+#ifdef __cplusplus
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+typedef uint32_t asset_id_t;
+
+//  Immutable, compiled form of an AmbientTopology: parents in a flat array,
+//  children in one contiguous array indexed by per-asset offsets
+//  (compressed sparse row). Names stay owned by the AmbientTopology it was
+//  compiled from, which must outlive it.
+class AmbientHierarchy{
+  public :
+    size_t size () const { return m_parents.size (); }
+    const std::string &name (asset_id_t id) const { return *m_names[id]; }
+    asset_id_t parent (asset_id_t id) const { return m_parents[id]; }
+    const asset_id_t *children_begin (asset_id_t id) const { return m_child_ids.data () + m_child_offsets[id]; }
+    const asset_id_t *children_end (asset_id_t id) const { return m_child_ids.data () + m_child_offsets[id + 1]; }
+    const std::vector<asset_id_t> &datacenters () const { return m_datacenters; }
+
+  private :
+    friend class AmbientTopology;
+    std::vector<const std::string *> m_names;
+    std::vector<asset_id_t> m_parents;
+    //  children of id are m_child_ids [m_child_offsets [id], m_child_offsets [id + 1]]
+    std::vector<uint32_t> m_child_offsets;
+    std::vector<asset_id_t> m_child_ids;
+    std::vector<asset_id_t> m_datacenters;
+};
+
+//  Asset names are interned once into dense ids. Relations are updated per
+//  asset message, then compiled into an AmbientHierarchy for the calculation,
+//  so it walks the hierarchy without any string hashing.
+//  Names and ids are never reclaimed: a removed asset keeps its id, without
+//  parent nor children, and every compiled version still has a slot for it.
+//  Memory and compile time thus grow with the distinct names ever seen, not
+//  the live assets. This is accepted: assets are removed and created again
+//  under the same name far more than renamed, and reusing an id would mean
+//  resetting every per-id table of both actors (sensor values, computed
+//  locations, timers) while older versions may still point to its name.
+class AmbientTopology{
+  public :
+    static const asset_id_t NONE;
+
+    //  Return the id of name, interning it if needed
+    asset_id_t intern (const std::string &name);
+    //  Return the id of name, or NONE if unknown
+    asset_id_t find (const std::string &name) const;
+    const std::string &name (asset_id_t id) const { return *m_names[id]; }
+    size_t size () const { return m_names.size (); }
+
+    asset_id_t parent (asset_id_t id) const { return m_parents[id]; }
+    //  Make id a child of parent, moving it from its previous parent if
+    //  any. Return the previous parent, or NONE. A parent which is id or
+    //  one of its descendants would make a cycle: id is left where it was
+    //  and id itself is returned.
+    asset_id_t attach (asset_id_t id, asset_id_t parent);
+    //  Remove id from the children of its parent, false if it has none
+    bool detach (asset_id_t id);
+
+    const std::vector<asset_id_t> &datacenters () const { return m_datacenters; }
+    bool is_datacenter (asset_id_t id) const { return m_datacenter_positions[id] != NONE; }
+    //  Return false if id is already a datacenter
+    bool add_datacenter (asset_id_t id);
+    //  Return false if id is not a datacenter
+    bool remove_datacenter (asset_id_t id);
+
+    //  Fill hierarchy with the current relations
+    void compile (AmbientHierarchy &hierarchy) const;
+
+  private :
+    std::unordered_map <std::string, asset_id_t> m_ids;
+    //  keys of m_ids, which never move
+    std::vector<const std::string *> m_names;
+    std::vector<asset_id_t> m_parents;
+    std::vector<std::vector<asset_id_t>> m_children;
+    //  index of each asset among the children of its parent
+    std::vector<uint32_t> m_positions;
+    std::vector<asset_id_t> m_datacenters;
+    //  index of each asset in m_datacenters, NONE if not a datacenter
+    std::vector<uint32_t> m_datacenter_positions;
+};
+
+//  @interface
+//  Self test of this class
+FTY_METRIC_AMBIENT_LOCATION_EXPORT void
+    fty_ambient_location_topology_test (bool verbose);
+
+//  @end
+extern "C" {
+#endif
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,80 @@
+/*  =========================================================================
+    fty_ambient_location_wheel - Hierarchical timing wheel scheduling expirations
+
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+#ifndef FTY_AMBIENT_LOCATION_WHEEL_H_INCLUDED
+#define FTY_AMBIENT_LOCATION_WHEEL_H_INCLUDED
+
+#ifdef __cplusplus
+#include <cstdint>
+#include <ctime>
+#include <vector>
+
+//  Timers with a one second resolution. Scheduling is O(1), each timer
+//  moves down at most once per level until it fires. Timers cannot be
+//  cancelled, owners ignore the ones they do not expect anymore.
+class AmbientTimingWheel{
+  public :
+    struct expiry_t {
+      time_t deadline;
+      uint64_t key;
+    };
+
+    explicit AmbientTimingWheel (time_t now = 0);
+    time_t now () const { return m_now; }
+    size_t size () const { return m_size; }
+
+    //  Fire key once the wheel reaches deadline, on next advance if already past
+    void schedule (time_t deadline, uint64_t key);
+    //  Move the wheel to now, appending the timers reached to expired
+    void advance (time_t now, std::vector<expiry_t> &expired);
+
+  private :
+    static const int BITS = 6;
+    static const int SLOTS = 1 << BITS;
+    static const int LEVELS = 4;
+
+    void place (const expiry_t &timer);
+    void tick (time_t now, std::vector<expiry_t> &expired);
+
+    //  a timer at level l shares its deadline bits above level l with m_now
+    std::vector<expiry_t> m_slots[LEVELS][SLOTS];
+    size_t m_counts[LEVELS];
+    //  beyond the last level, or already due
+    std::vector<expiry_t> m_overflow;
+    std::vector<expiry_t> m_due;
+    time_t m_now;
+    size_t m_size;
+};
+
+//  @interface
+//  Self test of this class
+FTY_METRIC_AMBIENT_LOCATION_EXPORT void
+    fty_ambient_location_wheel_test (bool verbose);
+
+//  @end
+extern "C" {
+#endif
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -100,6 +100,24 @@
 //  These classes are stable or legacy and built in all releases
 //  Draft classes are by default not built in stable releases
 #ifdef FTY_METRIC_AMBIENT_LOCATION_BUILD_DRAFT_API
+typedef struct _fty_ambient_location_topology_t fty_ambient_location_topology_t;
+#define FTY_AMBIENT_LOCATION_TOPOLOGY_T_DEFINED
+typedef struct _fty_ambient_location_pool_t fty_ambient_location_pool_t;
+#define FTY_AMBIENT_LOCATION_POOL_T_DEFINED
+typedef struct _fty_ambient_location_wheel_t fty_ambient_location_wheel_t;
+#define FTY_AMBIENT_LOCATION_WHEEL_T_DEFINED
+typedef struct _fty_ambient_location_clock_t fty_ambient_location_clock_t;
+#define FTY_AMBIENT_LOCATION_CLOCK_T_DEFINED
+typedef struct _fty_ambient_location_recording_t fty_ambient_location_recording_t;
+#define FTY_AMBIENT_LOCATION_RECORDING_T_DEFINED
+typedef struct _fty_ambient_location_stats_t fty_ambient_location_stats_t;
+#define FTY_AMBIENT_LOCATION_STATS_T_DEFINED
+typedef struct _fty_ambient_location_histogram_t fty_ambient_location_histogram_t;
+#define FTY_AMBIENT_LOCATION_HISTOGRAM_T_DEFINED
+typedef struct _fty_ambient_location_store_t fty_ambient_location_store_t;
+#define FTY_AMBIENT_LOCATION_STORE_T_DEFINED
+typedef struct _fty_ambient_location_metric_t fty_ambient_location_metric_t;
+#define FTY_AMBIENT_LOCATION_METRIC_T_DEFINED
 typedef struct _fty_ambient_location_server_t fty_ambient_location_server_t;
 #define FTY_AMBIENT_LOCATION_SERVER_T_DEFINED
 #endif // FTY_METRIC_AMBIENT_LOCATION_BUILD_DRAFT_API
@@ -107,6 +125,15 @@ typedef struct _fty_ambient_location_server_t fty_ambient_location_server_t;
 
 //  Public classes, each with its own header file
 #ifdef FTY_METRIC_AMBIENT_LOCATION_BUILD_DRAFT_API
+#include "fty_ambient_location_topology.h"
+#include "fty_ambient_location_pool.h"
+#include "fty_ambient_location_wheel.h"
+#include "fty_ambient_location_clock.h"
+#include "fty_ambient_location_recording.h"
+#include "fty_ambient_location_stats.h"
+#include "fty_ambient_location_histogram.h"
+#include "fty_ambient_location_store.h"
+#include "fty_ambient_location_metric.h"
 #include "fty_ambient_location_server.h"
 #endif // FTY_METRIC_AMBIENT_LOCATION_BUILD_DRAFT_API
 
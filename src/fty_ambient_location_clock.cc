@@ -0,0 +1,116 @@
+/*  =========================================================================
+    fty_ambient_location_clock - Wall clock of the calculation, real or simulated
+
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+
+/*
+@header
+    fty_ambient_location_clock - Wall clock of the calculation, real or simulated
+@discuss
+    The server reads time only through an AmbientClock. The system clock
+    is used in production; the virtual clock lets tests and benchmarks run
+    hours of sensor traffic in seconds, with the same averages published
+    whatever the speed.
+@end
+*/
+
+#include "fty_metric_ambient_location_classes.h"
+
+time_t AmbientSystemClock::now () const
+{
+  return std::time (NULL);
+}
+
+int64_t AmbientSystemClock::now_ms () const
+{
+  return zclock_time ();
+}
+
+int64_t AmbientSystemClock::mono () const
+{
+  return zclock_mono ();
+}
+
+int AmbientSystemClock::polling_interval () const
+{
+  return fty_get_polling_interval ();
+}
+
+AmbientVirtualClock::AmbientVirtualClock (time_t start, int interval) :
+  m_start (start),
+  m_interval (interval > 0 ? interval : 1),
+  m_now (start)
+{
+}
+
+time_t AmbientVirtualClock::advance (int seconds)
+{
+  if (seconds < 0)
+    seconds = 0;
+  return m_now += seconds;
+}
+
+time_t AmbientVirtualClock::set (time_t now)
+{
+  time_t current = m_now;
+  while (now > current && !m_now.compare_exchange_weak (current, now))
+    ;
+  return m_now;
+}
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+void
+fty_ambient_location_clock_test (bool verbose)
+{
+    printf (" * fty_ambient_location_clock: ");
+
+    //  @selftest
+    {
+        AmbientSystemClock clock;
+        time_t before = std::time (NULL);
+        time_t now = clock.now ();
+        assert (now >= before && now <= std::time (NULL));
+        assert (clock.now_ms () / 1000 >= before);
+        assert (clock.polling_interval () > 0);
+    }
+    {
+        AmbientVirtualClock clock (1000, 60);
+        const AmbientClock &base = clock;
+        assert (base.now () == 1000);
+        assert (base.mono () == 0);
+        assert (base.now_ms () == 1000000);
+        assert (base.polling_interval () == 60);
+        assert (clock.advance (60) == 1060);
+        assert (base.mono () == 60000);
+        //  never backward
+        assert (clock.advance (-5) == 1060);
+        assert (clock.set (1030) == 1060);
+        assert (clock.set (2000) == 2000);
+        assert (base.mono () == 1000000);
+        //  a zero interval would spin the calculation
+        AmbientVirtualClock fast (0, 0);
+        assert (fast.polling_interval () == 1);
+    }
+    //  @end
+    printf ("OK\n");
+}
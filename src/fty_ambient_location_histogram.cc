@@ -0,0 +1,172 @@
+/*  =========================================================================
+    fty_ambient_location_histogram - Log-linear latency histogram
+
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+
+/*
+@header
+    fty_ambient_location_histogram - Log-linear latency histogram
+@discuss
+    Values below 128 have their own bucket. Above, each power of two
+    [2^k, 2^(k+1)) is split in 64 buckets of width 2^(k-6), so a bucket
+    never spans more than 1/64 of its values. Percentiles report the
+    highest value of the bucket reached, as HdrHistogram does.
+@end
+*/
+
+#include "fty_metric_ambient_location_classes.h"
+#include <algorithm>
+#include <cinttypes>
+#include <string>
+
+AmbientHistogram::AmbientHistogram () :
+  m_count (0),
+  m_max (0)
+{
+  for (auto &count : m_counts)
+    count.store (0);
+}
+
+int AmbientHistogram::index (uint64_t value)
+{
+  if (value < uint64_t (SUB))
+    return int (value);
+  int msb = 63 - __builtin_clzll (value);
+  if (msb >= MAX_BITS)
+    return BUCKETS - 1;
+  int shift = msb - (SUB_BITS - 1);
+  return SUB + (shift - 1) * HALF + int ((value >> shift) - HALF);
+}
+
+uint64_t AmbientHistogram::highest (int index)
+{
+  if (index < SUB)
+    return uint64_t (index);
+  int shift = (index - SUB) / HALF + 1;
+  uint64_t sub = uint64_t ((index - SUB) % HALF + HALF);
+  return ((sub + 1) << shift) - 1;
+}
+
+void AmbientHistogram::record (uint64_t value)
+{
+  m_counts[index (value)].fetch_add (1, std::memory_order_relaxed);
+  m_count.fetch_add (1, std::memory_order_relaxed);
+  if (value > m_max.load (std::memory_order_relaxed))
+    m_max.store (value, std::memory_order_relaxed);
+}
+
+uint64_t AmbientHistogram::percentile (double percentile) const
+{
+  uint64_t total = count ();
+  if (total == 0)
+    return 0;
+  //  rank of the value, at least the first one
+  uint64_t rank = uint64_t (percentile / 100 * total + 0.5);
+  if (rank < 1)
+    rank = 1;
+  uint64_t seen = 0;
+  for (int i = 0; i < BUCKETS; i++) {
+    seen += m_counts[i].load (std::memory_order_relaxed);
+    //  the last bucket also holds whatever is beyond the range
+    if (seen >= rank)
+      return i == BUCKETS - 1 ? max () : std::min (highest (i), max ());
+  }
+  return max ();
+}
+
+void AmbientHistogram::append (zmsg_t *message, const char *name) const
+{
+  std::string prefix (name);
+  zmsg_addstr (message, (prefix + ".count").c_str ());
+  zmsg_addstrf (message, "%" PRIu64, count ());
+  zmsg_addstr (message, (prefix + ".p50").c_str ());
+  zmsg_addstrf (message, "%" PRIu64, percentile (50));
+  zmsg_addstr (message, (prefix + ".p99").c_str ());
+  zmsg_addstrf (message, "%" PRIu64, percentile (99));
+  zmsg_addstr (message, (prefix + ".p999").c_str ());
+  zmsg_addstrf (message, "%" PRIu64, percentile (99.9));
+  zmsg_addstr (message, (prefix + ".max").c_str ());
+  zmsg_addstrf (message, "%" PRIu64, max ());
+}
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+void
+fty_ambient_location_histogram_test (bool verbose)
+{
+    printf (" * fty_ambient_location_histogram: ");
+
+    //  @selftest
+    {
+        AmbientHistogram histogram;
+        assert (histogram.count () == 0);
+        assert (histogram.percentile (50) == 0);
+        //  small values are exact
+        for (uint64_t value = 0; value < 100; value++)
+            histogram.record (value);
+        assert (histogram.count () == 100);
+        assert (histogram.percentile (50) == 49);
+        assert (histogram.percentile (99) == 98);
+        assert (histogram.percentile (100) == 99);
+        assert (histogram.max () == 99);
+    }
+    {
+        //  1/64 relative error at most, whatever the magnitude: the median
+        //  of two is the upper bound of the bucket of the lower one
+        AmbientHistogram histogram;
+        for (uint64_t value = 100; value < (uint64_t (1) << 40); value = value * 3 / 2 + 7) {
+            AmbientHistogram two;
+            two.record (value);
+            two.record (value * 2);
+            uint64_t reported = two.percentile (50);
+            assert (reported >= value && reported - value <= value / 64);
+        }
+        //  beyond the range, counted in the last bucket
+        histogram.record (uint64_t (1) << 50);
+        assert (histogram.count () == 1);
+        assert (histogram.percentile (100) == uint64_t (1) << 50);
+    }
+    {
+        //  1000 values 1..1000 ms: p50 ~ 500, p99 ~ 990, p999 ~ 999
+        AmbientHistogram histogram;
+        for (uint64_t value = 1; value <= 1000; value++)
+            histogram.record (value);
+        uint64_t p50 = histogram.percentile (50);
+        uint64_t p99 = histogram.percentile (99);
+        uint64_t p999 = histogram.percentile (99.9);
+        assert (p50 >= 500 && p50 <= 508);
+        assert (p99 >= 990 && p99 <= 1000);
+        assert (p999 >= 999 && p999 <= 1000);
+
+        zmsg_t *message = zmsg_new ();
+        histogram.append (message, "latency");
+        assert (zmsg_size (message) == 10);
+        char *name = zmsg_popstr (message);
+        char *value = zmsg_popstr (message);
+        assert (streq (name, "latency.count") && streq (value, "1000"));
+        zstr_free (&name);
+        zstr_free (&value);
+        zmsg_destroy (&message);
+    }
+    //  @end
+    printf ("OK\n");
+}
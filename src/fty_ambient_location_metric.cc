@@ -0,0 +1,191 @@
+/*  =========================================================================
+    fty_ambient_location_metric - In place decoding of sensor metric messages
+
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+
+/*
+@header
+    fty_ambient_location_metric - In place decoding of sensor metric messages
+@discuss
+    Nearly all the messages the server receives are sensor metrics, of
+    which it only needs a few fields. fty_proto_decode builds a full
+    fty_proto_t for each, with a hash table and a copy of every string of
+    the aux field. The frame follows the zproto encoding of fty_proto:
+        uint16 signature, uint8 message id
+        aux:    uint32 count, then per entry a string key and a long
+                string value
+        time:   uint64
+        ttl:    uint32
+        type, name, value, unit: strings
+    where numbers are big endian, strings are an uint8 size then the
+    characters, and long strings an uint32 size then the characters.
+    The whole frame must be consumed, so any other layout is left to the
+    full decoder.
+@end
+*/
+
+#include "fty_metric_ambient_location_classes.h"
+
+//  Reads a frame the way the zproto codecs do
+struct ambient_needle_t {
+  const byte *needle;
+  const byte *ceiling;
+
+  bool number (uint64_t &value, int bytes)
+  {
+    if (ceiling - needle < bytes)
+      return false;
+    value = 0;
+    for (int i = 0; i < bytes; i++)
+      value = (value << 8) | *needle++;
+    return true;
+  }
+  bool string (const char *&data, size_t &size, int size_bytes)
+  {
+    uint64_t length;
+    if (!number (length, size_bytes) || uint64_t (ceiling - needle) < length)
+      return false;
+    data = (const char *) needle;
+    size = size_t (length);
+    needle += length;
+    return true;
+  }
+  bool string (std::string &value)
+  {
+    const char *data;
+    size_t size;
+    if (!string (data, size, 1))
+      return false;
+    value.assign (data, size);
+    return true;
+  }
+};
+
+AmbientMetric::AmbientMetric () :
+  m_ttl (0),
+  m_time (0)
+{
+}
+
+int AmbientMetric::decode (zmsg_t *message)
+{
+  if (zmsg_size (message) != 1)
+    return -1;
+  zframe_t *frame = zmsg_first (message);
+  ambient_needle_t reader = { zframe_data (frame), zframe_data (frame) + zframe_size (frame) };
+  uint64_t signature, id, count;
+  //the protocol number is checked by is_fty_proto, any zproto codec has 0xAAAx
+  if (!reader.number (signature, 2) || (signature & 0xfff0) != 0xaaa0
+  ||  !reader.number (id, 1) || id != FTY_PROTO_METRIC
+  ||  !reader.number (count, 4))
+    return -1;
+  m_sname.clear ();
+  for (uint64_t i = 0; i < count; i++) {
+    const char *key, *value;
+    size_t key_size, value_size;
+    if (!reader.string (key, key_size, 1) || !reader.string (value, value_size, 4))
+      return -1;
+    if (key_size == 5 && memcmp (key, "sname", 5) == 0)
+      m_sname.assign (value, value_size);
+  }
+  uint64_t ttl;
+  if (!reader.number (m_time, 8) || !reader.number (ttl, 4)
+  ||  !reader.string (m_type) || !reader.string (m_name) || !reader.string (m_value) || !reader.string (m_unit)
+  ||  reader.needle != reader.ceiling)
+    return -1;
+  m_ttl = uint32_t (ttl);
+  return 0;
+}
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+//  Decode message both ways and compare
+static void
+s_test_decode (AmbientMetric &metric, zmsg_t *message)
+{
+    assert (metric.decode (message) == 0);
+    zmsg_t *copy = zmsg_dup (message);
+    fty_proto_t *bmsg = fty_proto_decode (&copy);
+    assert (bmsg);
+    assert (metric.sname () == fty_proto_aux_string (bmsg, "sname", ""));
+    assert (metric.type () == fty_proto_type (bmsg));
+    assert (metric.name () == fty_proto_name (bmsg));
+    assert (metric.value () == fty_proto_value (bmsg));
+    assert (metric.unit () == fty_proto_unit (bmsg));
+    assert (metric.ttl () == fty_proto_ttl (bmsg));
+    assert (metric.time () == fty_proto_time (bmsg));
+    fty_proto_destroy (&bmsg);
+}
+
+void
+fty_ambient_location_metric_test (bool verbose)
+{
+    printf (" * fty_ambient_location_metric: ");
+
+    //  @selftest
+    AmbientMetric metric;
+    zhash_t *aux = zhash_new ();
+    zhash_autofree (aux);
+    zhash_insert (aux, "port", (void *) "1");
+    zhash_insert (aux, "sname", (void *) "sensor-241");
+    zhash_insert (aux, "long", (void *) std::string (300, 'x').c_str ());
+    zmsg_t *message = fty_proto_encode_metric (aux, 1600000000, 300, "temperature.0", "epdu-12", "21.5", "C");
+    s_test_decode (metric, message);
+    assert (metric.sname () == "sensor-241");
+    assert (metric.type () == "temperature.0");
+    assert (metric.value () == "21.5");
+    assert (metric.ttl () == 300 && metric.time () == 1600000000);
+    assert (zmsg_size (message) == 1);
+
+    //  without aux nor unit, fields of the previous message are forgotten
+    zmsg_t *bare = fty_proto_encode_metric (NULL, uint64_t (1) << 40, 0xffffffff, "humidity.1", "ups-1", "", "");
+    s_test_decode (metric, bare);
+    assert (metric.sname () == "" && metric.value () == "" && metric.unit () == "");
+    zmsg_destroy (&bare);
+
+    //  truncated, with a frame too many, not a metric
+    zframe_t *frame = zmsg_first (message);
+    zmsg_t *truncated = zmsg_new ();
+    zmsg_addmem (truncated, zframe_data (frame), zframe_size (frame) - 1);
+    assert (metric.decode (truncated) == -1);
+    zmsg_destroy (&truncated);
+    zmsg_t *longer = zmsg_new ();
+    zmsg_addmem (longer, zframe_data (frame), zframe_size (frame));
+    zmsg_addmem (longer, "\0", 1);
+    assert (zmsg_size (longer) == 2 && metric.decode (longer) == -1);
+    zmsg_destroy (&longer);
+    zmsg_t *extra = zmsg_new ();
+    std::string data ((const char *) zframe_data (frame), zframe_size (frame));
+    data.push_back ('\0');
+    zmsg_addmem (extra, data.data (), data.size ());
+    assert (metric.decode (extra) == -1);
+    zmsg_destroy (&extra);
+    zmsg_destroy (&message);
+
+    zhash_update (aux, "type", (void *) "device");
+    message = fty_proto_encode_asset (aux, "sensor-241", FTY_PROTO_ASSET_OP_CREATE, NULL);
+    assert (metric.decode (message) == -1);
+    zmsg_destroy (&message);
+    zhash_destroy (&aux);
+    //  @end
+    printf ("OK\n");
+}
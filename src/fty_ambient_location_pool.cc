@@ -0,0 +1,197 @@
+/*  =========================================================================
+    fty_ambient_location_pool - Work stealing pool computing independent subtrees
+
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+/*
+@header
+    fty_ambient_location_pool - Work stealing pool computing independent subtrees
+@discuss
+    A batch is split in contiguous blocks, one per thread. Threads pop from
+    the back of their own queue and steal from the front of the others,
+    the caller of run working as one of them until the batch is done.
+@end
+*/
+
+#include "fty_metric_ambient_location_classes.h"
+
+AmbientWorkerPool::AmbientWorkerPool (size_t threads) :
+  m_task (NULL),
+  m_generation (0),
+  m_pending (0),
+  m_stop (false)
+{
+  if (threads == 0)
+    threads = 1;
+  for (size_t i = 0; i < threads; i++)
+    m_queues.emplace_back (new queue_t ());
+  for (size_t i = 1; i < threads; i++)
+    m_threads.emplace_back (&AmbientWorkerPool::worker_main, this, i);
+}
+
+AmbientWorkerPool::~AmbientWorkerPool ()
+{
+  {
+    std::lock_guard<std::mutex> lock (m_mutex);
+    m_stop = true;
+  }
+  m_wake.notify_all ();
+  for (auto &thread : m_threads)
+    thread.join ();
+}
+
+bool AmbientWorkerPool::pop (size_t worker, uint64_t generation, size_t &index)
+{
+  {
+    queue_t &own = *m_queues[worker];
+    std::lock_guard<std::mutex> lock (own.mutex);
+    if (own.generation == generation && !own.tasks.empty ()) {
+      index = own.tasks.back ();
+      own.tasks.pop_back ();
+      return true;
+    }
+  }
+  for (size_t i = 1; i < m_queues.size (); i++) {
+    queue_t &victim = *m_queues[(worker + i) % m_queues.size ()];
+    std::lock_guard<std::mutex> lock (victim.mutex);
+    if (victim.generation == generation && !victim.tasks.empty ()) {
+      index = victim.tasks.front ();
+      victim.tasks.pop_front ();
+      return true;
+    }
+  }
+  return false;
+}
+
+void AmbientWorkerPool::work (size_t worker, uint64_t generation, const std::function<void (size_t)> &task)
+{
+  size_t index;
+  while (pop (worker, generation, index)) {
+    task (index);
+    std::lock_guard<std::mutex> lock (m_mutex);
+    if (--m_pending == 0)
+      m_done.notify_all ();
+  }
+}
+
+void AmbientWorkerPool::worker_main (size_t worker)
+{
+  uint64_t seen = 0;
+  while (true) {
+    const std::function<void (size_t)> *task;
+    {
+      std::unique_lock<std::mutex> lock (m_mutex);
+      m_wake.wait (lock, [&] { return m_stop || m_generation != seen; });
+      if (m_stop)
+        return;
+      seen = m_generation;
+      task = m_task;
+    }
+    //  woken too late, the batch is over already
+    if (!task)
+      continue;
+    //  queues only hold tasks of a later batch if this one is over
+    work (worker, seen, *task);
+  }
+}
+
+void AmbientWorkerPool::run (size_t count, const std::function<void (size_t)> &task)
+{
+  if (count == 0)
+    return;
+  if (m_threads.empty ()) {
+    for (size_t i = 0; i < count; i++)
+      task (i);
+    return;
+  }
+
+  uint64_t generation;
+  {
+    std::lock_guard<std::mutex> lock (m_mutex);
+    generation = ++m_generation;
+    m_task = &task;
+    m_pending = count;
+    size_t threads = m_queues.size ();
+    for (size_t worker = 0; worker < threads; worker++) {
+      queue_t &queue = *m_queues[worker];
+      std::lock_guard<std::mutex> queue_lock (queue.mutex);
+      queue.tasks.clear ();
+      //  block in reverse, so the owner pops them in order
+      for (size_t i = (worker + 1) * count / threads; i > worker * count / threads; i--)
+        queue.tasks.push_back (i - 1);
+      queue.generation = generation;
+    }
+  }
+  m_wake.notify_all ();
+
+  work (0, generation, task);
+  std::unique_lock<std::mutex> lock (m_mutex);
+  m_done.wait (lock, [&] { return m_pending == 0; });
+  m_task = NULL;
+}
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+void
+fty_ambient_location_pool_test (bool verbose)
+{
+    printf (" * fty_ambient_location_pool: ");
+
+    //  @selftest
+    //  serial pool runs in order on the caller
+    {
+        AmbientWorkerPool pool (1);
+        assert (pool.size () == 1);
+        std::vector<size_t> order;
+        pool.run (5, [&] (size_t i) { order.push_back (i); });
+        assert (order == std::vector<size_t> ({0, 1, 2, 3, 4}));
+    }
+
+    //  every task runs exactly once, batch after batch
+    {
+        AmbientWorkerPool pool (4);
+        assert (pool.size () == 4);
+        for (size_t count : {0, 1, 3, 100, 1000}) {
+            std::vector<int> runs (count, 0);
+            pool.run (count, [&] (size_t i) { runs[i]++; });
+            for (int n : runs)
+                assert (n == 1);
+        }
+    }
+
+    //  a slow block is stolen by the other threads: the caller owns the
+    //  slow tasks 0-3, the worker runs its own 4-7 then takes some of them
+    {
+        AmbientWorkerPool pool (2);
+        std::vector<std::thread::id> threads (8);
+        pool.run (8, [&] (size_t i) {
+            if (i < 4)
+                std::this_thread::sleep_for (std::chrono::milliseconds (50));
+            threads[i] = std::this_thread::get_id ();
+        });
+        size_t stolen = 0;
+        for (size_t i = 0; i < 4; i++)
+            stolen += threads[i] != std::this_thread::get_id ();
+        assert (stolen >= 1);
+    }
+    //  @end
+    printf ("OK\n");
+}
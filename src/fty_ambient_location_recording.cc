@@ -0,0 +1,290 @@
+/*  =========================================================================
+    fty_ambient_location_recording - Length-prefixed recording of stream messages
+
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+
+/*
+@header
+    fty_ambient_location_recording - Length-prefixed recording of stream messages
+@discuss
+    The server records the METRICS_SENSOR and ASSETS messages it consumes
+    (RECORD command), the fty-metric-ambient-location --replay mode feeds
+    them back. Records are written through stdio buffering; a record cut
+    by a crash is reported as truncated when read.
+@end
+*/
+
+#include "fty_metric_ambient_location_classes.h"
+#include <algorithm>
+
+#define RECORDING_MAGIC "FTYAMBR1"
+#define RECORDING_MAGIC_SIZE 8
+//  nothing the agent consumes comes close
+#define RECORDING_MAX_RECORD (64 * 1024 * 1024)
+
+static void
+s_put (std::string &buffer, uint64_t value, int bytes)
+{
+  for (int i = 0; i < bytes; i++)
+    buffer.push_back (char ((value >> (8 * i)) & 0xff));
+}
+
+static uint64_t
+s_get (const std::string &buffer, size_t &offset, int bytes)
+{
+  uint64_t value = 0;
+  for (int i = 0; i < bytes; i++)
+    value |= uint64_t ((unsigned char) buffer[offset + i]) << (8 * i);
+  offset += bytes;
+  return value;
+}
+
+AmbientRecorder::AmbientRecorder () :
+  m_file (NULL),
+  m_records (0)
+{
+}
+
+AmbientRecorder::~AmbientRecorder ()
+{
+  close ();
+}
+
+int AmbientRecorder::open (const char *path)
+{
+  close ();
+  m_file = fopen (path, "wb");
+  if (!m_file) {
+    log_error ("Cannot create recording %s: %s", path, strerror (errno));
+    return -1;
+  }
+  m_records = 0;
+  if (fwrite (RECORDING_MAGIC, 1, RECORDING_MAGIC_SIZE, m_file) != RECORDING_MAGIC_SIZE) {
+    close ();
+    return -1;
+  }
+  return 0;
+}
+
+int AmbientRecorder::write (int64_t time, const char *stream, zmsg_t *message)
+{
+  if (!m_file)
+    return -1;
+  size_t stream_size = std::min<size_t> (strlen (stream), 255);
+  m_buffer.clear ();
+  s_put (m_buffer, 0, 4);
+  s_put (m_buffer, uint64_t (time), 8);
+  s_put (m_buffer, stream_size, 1);
+  m_buffer.append (stream, stream_size);
+  for (zframe_t *frame = zmsg_first (message); frame; frame = zmsg_next (message)) {
+    s_put (m_buffer, zframe_size (frame), 4);
+    m_buffer.append ((const char *) zframe_data (frame), zframe_size (frame));
+  }
+  std::string size;
+  s_put (size, m_buffer.size () - 4, 4);
+  m_buffer.replace (0, 4, size);
+  if (fwrite (m_buffer.data (), 1, m_buffer.size (), m_file) != m_buffer.size ()) {
+    log_error ("Cannot write recording: %s", strerror (errno));
+    return -1;
+  }
+  m_records++;
+  return 0;
+}
+
+void AmbientRecorder::close ()
+{
+  if (m_file)
+    fclose (m_file);
+  m_file = NULL;
+}
+
+AmbientRecording::AmbientRecording () :
+  m_file (NULL)
+{
+}
+
+AmbientRecording::~AmbientRecording ()
+{
+  close ();
+}
+
+int AmbientRecording::open (const char *path)
+{
+  close ();
+  m_file = fopen (path, "rb");
+  if (!m_file) {
+    log_error ("Cannot open recording %s: %s", path, strerror (errno));
+    return -1;
+  }
+  char magic[RECORDING_MAGIC_SIZE];
+  if (fread (magic, 1, RECORDING_MAGIC_SIZE, m_file) != RECORDING_MAGIC_SIZE
+  ||  memcmp (magic, RECORDING_MAGIC, RECORDING_MAGIC_SIZE) != 0) {
+    log_error ("%s is not a recording", path);
+    close ();
+    return -1;
+  }
+  return 0;
+}
+
+int AmbientRecording::read (int64_t &time, std::string &stream, zmsg_t **message)
+{
+  if (!m_file)
+    return -1;
+  unsigned char header[4];
+  size_t got = fread (header, 1, 4, m_file);
+  if (got == 0 && feof (m_file))
+    return 0;
+  if (got != 4)
+    return -1;
+  size_t offset = 0;
+  m_buffer.assign ((const char *) header, 4);
+  size_t size = s_get (m_buffer, offset, 4);
+  if (size < 9 || size > RECORDING_MAX_RECORD)
+    return -1;
+  m_buffer.resize (size);
+  if (fread (&m_buffer[0], 1, size, m_file) != size)
+    return -1;
+
+  offset = 0;
+  time = int64_t (s_get (m_buffer, offset, 8));
+  size_t stream_size = s_get (m_buffer, offset, 1);
+  if (offset + stream_size > size)
+    return -1;
+  stream.assign (m_buffer, offset, stream_size);
+  offset += stream_size;
+  zmsg_t *msg = zmsg_new ();
+  while (offset < size) {
+    if (offset + 4 > size) {
+      zmsg_destroy (&msg);
+      return -1;
+    }
+    size_t frame_size = s_get (m_buffer, offset, 4);
+    if (offset + frame_size > size) {
+      zmsg_destroy (&msg);
+      return -1;
+    }
+    zmsg_addmem (msg, m_buffer.data () + offset, frame_size);
+    offset += frame_size;
+  }
+  *message = msg;
+  return 1;
+}
+
+void AmbientRecording::close ()
+{
+  if (m_file)
+    fclose (m_file);
+  m_file = NULL;
+}
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+void
+fty_ambient_location_recording_test (bool verbose)
+{
+    printf (" * fty_ambient_location_recording: ");
+
+    //  @selftest
+    //  Note: If your selftest reads SCMed fixture data, please keep it in
+    //  src/selftest-ro; if your test creates filesystem objects, please
+    //  do so under src/selftest-rw.
+    const char *SELFTEST_DIR_RW = "src/selftest-rw";
+    std::string path = std::string (SELFTEST_DIR_RW) + "/recording.bin";
+
+    {
+        AmbientRecorder recorder;
+        assert (recorder.open (path.c_str ()) == 0);
+        for (int i = 0; i < 3; i++) {
+            zmsg_t *msg = zmsg_new ();
+            zmsg_addstr (msg, ("message-" + std::to_string (i)).c_str ());
+            zmsg_addmem (msg, NULL, 0);
+            zmsg_addmem (msg, "\0\1\2", 3);
+            assert (recorder.write (1000 + i, i % 2 ? "ASSETS" : "METRICS_SENSOR", msg) == 0);
+            assert (zmsg_size (msg) == 3);
+            zmsg_destroy (&msg);
+        }
+        assert (recorder.records () == 3);
+    }
+    {
+        AmbientRecording recording;
+        assert (recording.open (path.c_str ()) == 0);
+        int64_t time;
+        std::string stream;
+        zmsg_t *msg = NULL;
+        for (int i = 0; i < 3; i++) {
+            assert (recording.read (time, stream, &msg) == 1);
+            assert (time == 1000 + i);
+            assert (stream == (i % 2 ? "ASSETS" : "METRICS_SENSOR"));
+            assert (zmsg_size (msg) == 3);
+            char *first = zmsg_popstr (msg);
+            assert (first && streq (first, ("message-" + std::to_string (i)).c_str ()));
+            zstr_free (&first);
+            zframe_t *frame = zmsg_pop (msg);
+            assert (zframe_size (frame) == 0);
+            zframe_destroy (&frame);
+            frame = zmsg_pop (msg);
+            assert (zframe_size (frame) == 3 && memcmp (zframe_data (frame), "\0\1\2", 3) == 0);
+            zframe_destroy (&frame);
+            zmsg_destroy (&msg);
+        }
+        assert (recording.read (time, stream, &msg) == 0);
+    }
+
+    //  a record cut in the middle is reported
+    {
+        FILE *file = fopen (path.c_str (), "rb");
+        std::string content;
+        char buffer[256];
+        size_t got;
+        while ((got = fread (buffer, 1, sizeof (buffer), file)) > 0)
+            content.append (buffer, got);
+        fclose (file);
+        file = fopen (path.c_str (), "wb");
+        fwrite (content.data (), 1, content.size () - 2, file);
+        fclose (file);
+
+        AmbientRecording recording;
+        assert (recording.open (path.c_str ()) == 0);
+        int64_t time;
+        std::string stream;
+        zmsg_t *msg = NULL;
+        assert (recording.read (time, stream, &msg) == 1);
+        zmsg_destroy (&msg);
+        assert (recording.read (time, stream, &msg) == 1);
+        zmsg_destroy (&msg);
+        assert (recording.read (time, stream, &msg) == -1);
+        assert (msg == NULL);
+    }
+
+    //  not a recording
+    {
+        AmbientRecording recording;
+        assert (recording.open ((std::string (SELFTEST_DIR_RW) + "/missing.bin").c_str ()) == -1);
+        FILE *file = fopen (path.c_str (), "wb");
+        fputs ("garbage", file);
+        fclose (file);
+        assert (recording.open (path.c_str ()) == -1);
+    }
+    unlink (path.c_str ());
+    //  @end
+    printf ("OK\n");
+}
@@ -28,9 +28,15 @@
 
 #include "fty_metric_ambient_location_classes.h"
 #include <unordered_map>
+#include <algorithm>
 #include <cmath>
+#include <limits>
 #include <ctime>
 #include <mutex>
+#include <cinttypes>
+#include <thread>
+#include <chrono>
+#include <iterator>
 #include <fty_shm.h>
 
 std::mutex mtx_ambient_hashmap;
@@ -39,7 +45,9 @@ std::mutex mtx_ambient_hashmap;
 #define NaN sqrt(-2)
 #define AMBIENT_LOCATION_TYPE_HUMIDITY 0
 #define AMBIENT_LOCATION_TYPE_TEMP 1
-#define AMBIENT_LOCATION_TYPE_BOTH 2
+//expiry timer keys are the asset id shifted by 2, with one of the types
+//above (sensor value expiry) or this one (location refresh)
+#define AMBIENT_LOCATION_TIMER_REFRESH 2
 
 
 #define ANSI_COLOR_REDTHIN "\x1b[0;31m"
@@ -54,18 +62,55 @@ std::mutex mtx_ambient_hashmap;
 #define ANSI_COLOR_LIGHTMAGENTA    "\x1b[1;95m"
 #define ANSI_COLOR_RESET   "\x1b[0m"
 
-//  Structure of our class
+#define AMBIENT_LOCATION_NEVER_EXPIRE std::numeric_limits<time_t>::max()
+
+//a new topology version is built once asset messages stop for that long,
+//or at the latest that long after the first change (REPUBLISH burst)
+#define TOPOLOGY_SETTLE_MS 100
+#define TOPOLOGY_MAX_DELAY_MS 1000
+//on START, the calculation waits for the answer to REPUBLISH: until asset
+//messages stop for that long, or at the latest that long after START
+#define BULK_LOAD_SETTLE_MS 2000
+#define BULK_LOAD_MAX_MS 60000
+//messages of each lane the stream actor receives per wakeup, before it
+//serves the other lane, its pipe and timers again
+#define METRICS_BATCH_MAX 1024
+#define ASSETS_BATCH_MAX 256
+//sensor metrics subjects are <type>@<device>, only temperatures and
+//humidities are consumed (subscription/narrow), from at most that many
+//devices per consumer pattern
+#define METRICS_SUBJECT_KINDS "^(temperature|humidity)[^@]*@"
+#define SUBSCRIPTION_DEVICES_MAX 32
+
+//asset name of the statistics written in shm (stats/publish)
+#define AMBIENT_LOCATION_STATS_ASSET "fty-metric-ambient-location"
+
+//  What a location publishes, indexed by ambient_location_kind_t
+struct ambient_publish_policy_t {
+  //  average.{temperature,humidity}-{input,output}
+  bool per_function;
+  //  average.{temperature,humidity}, the parent then sees this average
+  //  as the output value of the location
+  bool global;
+};
 
-struct value {
-  double value;
-  int ttl;
+static const ambient_publish_policy_t s_publish_policy[] = {
+  { false, true },    // AMBIENT_LOCATION_KIND_OTHER
+  { true, true },     // AMBIENT_LOCATION_KIND_ROW
+  { true, false }     // AMBIENT_LOCATION_KIND_RACK
 };
 
-struct ambient_values_t {
-  value in_temperature;
-  value in_humidity;
-  value out_temperature;
-  value out_humidity;
+//  Metric type and unit, indexed by ambient_output_t
+static const struct {
+  const char *type;
+  const char *unit;
+} s_outputs[] = {
+  { "average.temperature-input", "C" },
+  { "average.humidity-input", "%" },
+  { "average.temperature-output", "C" },
+  { "average.humidity-output", "%" },
+  { "average.temperature", "C" },
+  { "average.humidity", "%" }
 };
 
 //  --------------------------------------------------------------------------
@@ -73,6 +118,71 @@ struct ambient_values_t {
 
 AmbientLocation::AmbientLocation() {
   this->client = mlm_client_new ();
+  this->metrics_client = mlm_client_new ();
+  this->ambient_calculation = NULL;
+  this->topology_changed = false;
+  this->topology_changed_since = 0;
+  this->topology_version = 0;
+  this->bulk_loading = false;
+  this->bulk_load_started = 0;
+  this->bulk_load_last = 0;
+  this->topology_consumed = 0;
+  this->monitor = false;
+  this->deadband = 0;
+  this->refresh = 50;
+  this->threads = 1;
+  this->debounce_ms = 0;
+  this->max_latency_ms = 1000;
+  this->updates_last = 0;
+  this->stats_publish = false;
+  this->values_interval = 60;
+  this->values_saved = 0;
+  this->narrow = false;
+  this->metrics_consumer = false;
+  this->subscription_changed = false;
+  this->subscribed_all = false;
+  this->ingest_shm = false;
+  this->ingest_interval_ms = 1000;
+  this->ingest_next = 0;
+  this->clock.reset (new AmbientSystemClock ());
+  this->simulation = NULL;
+}
+
+static void
+s_load_config (AmbientLocation* self, const char *path)
+{
+  zconfig_t *config = zconfig_load (path);
+  if (!config) {
+    log_warning ("Failed to load config file %s, keep default settings", path);
+    return;
+  }
+  self->deadband = atof (zconfig_get (config, "publish/deadband", "0"));
+  self->refresh = atoi (zconfig_get (config, "publish/refresh", "50"));
+  if (self->refresh < 0 || self->refresh > 100) {
+    log_warning ("publish/refresh must be a percentage, using 50");
+    self->refresh = 50;
+  }
+  self->threads = atoi (zconfig_get (config, "calculation/threads", "1"));
+  if (self->threads <= 0)
+    self->threads = std::max (1u, std::thread::hardware_concurrency ());
+  self->debounce_ms = std::max (0, atoi (zconfig_get (config, "calculation/debounce", "0")));
+  self->max_latency_ms = std::max (self->debounce_ms, atoi (zconfig_get (config, "calculation/max_latency", "1000")));
+  const char *stats_publish = zconfig_get (config, "stats/publish", "false");
+  self->stats_publish = streq (stats_publish, "true") || streq (stats_publish, "1");
+  self->topology_path = zconfig_get (config, "store/topology", "");
+  self->values_path = zconfig_get (config, "store/values", "");
+  self->values_interval = atoi (zconfig_get (config, "store/interval", "60"));
+  const char *narrow = zconfig_get (config, "subscription/narrow", "false");
+  self->narrow = streq (narrow, "true") || streq (narrow, "1");
+  const char *backend = zconfig_get (config, "ingest/backend", "stream");
+  self->ingest_shm = streq (backend, "shm");
+  if (!self->ingest_shm && !streq (backend, "stream"))
+    log_warning ("ingest/backend must be stream or shm, using stream");
+  self->ingest_interval_ms = std::max (10, atoi (zconfig_get (config, "ingest/interval", "1000")));
+  log_info ("Config %s loaded (deadband: %.2f, refresh: %d%%, threads: %d, debounce: %d ms, ingest: %s, stats: %s)", path,
+    self->deadband, self->refresh, self->threads, self->debounce_ms, self->ingest_shm ? "shm" : "stream",
+    self->stats_publish ? "published" : "on request");
+  zconfig_destroy (&config);
 }
 
 /*
@@ -81,8 +191,24 @@ AmbientLocation::AmbientLocation() {
  * 0 - message processed and deleted
  */
 
+static void s_publish_topology (AmbientLocation* self);
+static void s_load_topology (AmbientLocation* self);
+static void s_start_calculation (AmbientLocation* self);
+static void s_end_bulk_load (AmbientLocation* self);
+static void s_mark_dirty (AmbientLocation* self, asset_id_t id);
+
+//append the statistics, then the latency percentiles, as name/value frames
+static void s_append_stats (AmbientLocation* self, zmsg_t *message) {
+  self->stats.append (message);
+  self->sensor_latency.append (message, "latency.sensor_to_ingest_ms");
+  self->publish_latency.append (message, "latency.ingest_to_publish_ms");
+}
+static void s_ambloc_actor_stream (AmbientLocation* self, const char *stream, zmsg_t **message_p);
+static void s_flush_updates (AmbientLocation* self);
+static void s_ingest_shm (AmbientLocation* self);
+
 static int
-s_ambloc_actor_commands (AmbientLocation* self, zmsg_t **message_p)
+s_ambloc_actor_commands (AmbientLocation* self, zsock_t *pipe, zmsg_t **message_p)
 {
     assert (self);
     assert(message_p && *message_p);
@@ -111,9 +237,13 @@ s_ambloc_actor_commands (AmbientLocation* self, zmsg_t **message_p)
       if (endpoint && name) {
         log_debug ("ambient_actor: CONNECT: %s/%s", endpoint, name);
         int rv = mlm_client_connect (self->client, endpoint, 1000, name);
+        if (rv != -1)
+          rv = mlm_client_connect (self->metrics_client, endpoint, 1000, (std::string (name) + "-metrics").c_str ());
 
         if (rv == -1)
           log_error("mlm_client_connect failed\n");
+        self->endpoint = endpoint;
+        self->metrics_name = std::string (name) + "-metrics";
       }
 
       zstr_free (&endpoint);
@@ -127,23 +257,118 @@ s_ambloc_actor_commands (AmbientLocation* self, zmsg_t **message_p)
 
         if (stream && regex) {
             log_debug ("CONSUMER: %s/%s", stream, regex);
-            int rv = mlm_client_set_consumer (self->client, stream, regex);
-            if (rv == -1 )
-                log_error("mlm_set_consumer failed");
+            //sensor metrics have their own lane, narrowed to the known
+            //sensors from the first topology version on
+            bool metrics = streq (stream, FTY_PROTO_STREAM_METRICS_SENSOR);
+            if (metrics && self->ingest_shm)
+                log_info ("Sensor metrics read in shm, %s not consumed", stream);
+            else
+            if (metrics && self->narrow && streq (regex, ".*")) {
+                self->metrics_consumer = true;
+                self->subscription_changed = true;
+            }
+            else {
+                int rv = mlm_client_set_consumer (metrics ? self->metrics_client : self->client, stream, regex);
+                if (rv == -1 )
+                    log_error("mlm_set_consumer failed");
+            }
         }
 
         zstr_free (&stream);
         zstr_free (&regex);
+    }
+    else
+    if (streq (command, "CONFIG"))
+    {
+        char *path = zmsg_popstr(message);
+        if (path)
+            s_load_config (self, path);
+        zstr_free (&path);
+    } else if (streq (command, "MONITOR")) {
+      self->monitor = true;
+    } else if (streq (command, "STATS")) {
+      //STATS: answered by STATS/name/value/...
+      zmsg_t *reply = zmsg_new ();
+      zmsg_addstr (reply, "STATS");
+      s_append_stats (self, reply);
+      zmsg_send (&reply, pipe);
+    } else if (streq (command, "SIMULATE")) {
+      //SIMULATE/start time (0 for now)/seconds between calculations
+      char *start = zmsg_popstr (message);
+      char *interval = zmsg_popstr (message);
+      if (self->ambient_calculation)
+        log_error ("SIMULATE must be sent before START");
+      else {
+        time_t start_time = start ? (time_t) atoll (start) : 0;
+        self->simulation = new AmbientVirtualClock (start_time ? start_time : std::time (NULL),
+          interval ? atoi (interval) : fty_get_polling_interval ());
+        self->clock.reset (self->simulation);
+        log_info ("Simulation mode, calculation every %d s of virtual time", self->simulation->polling_interval ());
+      }
+      zstr_free (&start);
+      zstr_free (&interval);
+    } else if (streq (command, "TICK")) {
+      //TICK/[seconds, default the polling interval]: move the virtual clock
+      //then run one calculation, answered by its CYCLE report
+      char *seconds = zmsg_popstr (message);
+      if (self->simulation && self->bulk_loading)
+        s_end_bulk_load (self);
+      if (!self->simulation || !self->ambient_calculation) {
+        log_error ("TICK needs SIMULATE and START");
+        zstr_send (pipe, "ERROR");
+      }
+      else {
+        if (self->topology_changed)
+          s_publish_topology (self);
+        if (self->ingest_shm) {
+          s_ingest_shm (self);
+          s_flush_updates (self);
+        }
+        self->simulation->advance (seconds ? atoi (seconds) : self->simulation->polling_interval ());
+        zstr_send (self->ambient_calculation, "TICK");
+        zmsg_t *report = zmsg_recv (self->ambient_calculation);
+        if (report)
+          zmsg_send (&report, pipe);
+      }
+      zstr_free (&seconds);
+    } else if (streq (command, "RECORD")) {
+      //RECORD/path: copy the stream messages consumed from now on
+      char *path = zmsg_popstr (message);
+      if (path && self->recorder.open (path) == 0)
+        log_info ("Recording stream messages in %s", path);
+      zstr_free (&path);
+    } else if (streq (command, "STREAM")) {
+      //STREAM/stream/message frames: handle a message as if it came from the
+      //stream, in order with the other commands (replay)
+      char *stream = zmsg_popstr (message);
+      if (stream && is_fty_proto (message)) {
+        s_ambloc_actor_stream (self, stream, message_p);
+        s_flush_updates (self);
+      }
+      zstr_free (&stream);
     } else if (streq (command, "START")) {
-      zmsg_t *msg = zmsg_new ();
-      zmsg_addstr (msg, "$all");
-      int rv = mlm_client_sendto (self->client, "asset-agent", "REPUBLISH", NULL, 5000, &msg);
-      if (rv != 0){
-        log_error ("Request assets list failed");
-        return 1;
-      }else
-          log_debug ("Assets list request sent successfully");
-      self->ambient_calculation = zactor_new(ambient_location_calculation, (void*) self);
+      //the saved topology is calculated at once, REPUBLISH then reconciles it
+      s_load_topology (self);
+      //without broker (replay), the assets come from the stream only
+      if (mlm_client_connected (self->client)) {
+        zmsg_t *msg = zmsg_new ();
+        zmsg_addstr (msg, "$all");
+        int rv = mlm_client_sendto (self->client, "asset-agent", "REPUBLISH", NULL, 5000, &msg);
+        if (rv != 0){
+          log_error ("Request assets list failed");
+          zstr_free (&command);
+          zmsg_destroy (message_p);
+          return 1;
+        }else
+            log_debug ("Assets list request sent successfully");
+        self->bulk_loading = true;
+        self->bulk_load_started = self->bulk_load_last = self->clock->mono ();
+        self->stats.set (AMBIENT_STAT_STARTUP_ASSETS, 0);
+      }
+      else
+        self->topology_confirmed.clear ();
+      if (!self->bulk_loading || !self->topology_confirmed.empty ())
+        s_start_calculation (self);
     }
     else {
         log_error ("Unknown actor command: %s.\n", command);
@@ -154,114 +379,166 @@ s_ambloc_actor_commands (AmbientLocation* self, zmsg_t **message_p)
     return 0;
 }
 
-static void s_remove_from_cache(AmbientLocation* self, std::string name, int type) {
-  if(type == AMBIENT_LOCATION_TYPE_HUMIDITY || type == AMBIENT_LOCATION_TYPE_BOTH) {
-    if(self->cache.at(name).second.first != NULL) {
-      fty_proto_destroy(& self->cache.at(name).second.first);
-      self->cache.at(name).second.first = NULL;
-    }
-  }
-  if(type == AMBIENT_LOCATION_TYPE_TEMP || type == AMBIENT_LOCATION_TYPE_BOTH) {
-    if(self->cache.at(name).second.second != NULL) {
-      fty_proto_destroy(& self->cache.at(name).second.second);
-      self->cache.at(name).second.second = NULL;
-    }
-  }
+static ambient_slot_t& s_cache_slot(ambient_sensor_t& sensor, int type) {
+  return type == AMBIENT_LOCATION_TYPE_HUMIDITY ? sensor.humidity : sensor.temperature;
 }
 
-static void s_publish_value(std::string type, std::string unit, std::string name, double value, int ttl) {
-  fty_proto_t *n_met = fty_proto_new(FTY_PROTO_METRIC);
-  fty_proto_set_name(n_met, name.c_str());
-  fty_proto_set_type(n_met,type.c_str());
-  fty_proto_set_value(n_met, "%.2f", value);
-  fty_proto_set_unit(n_met, "%s", unit.c_str());
-  fty_proto_set_ttl(n_met, ttl);
-  fty_proto_set_time(n_met, std::time (NULL));
+static ambient_location_kind_t s_location_kind(const char *type) {
+  if(streq(type, "rack"))
+    return AMBIENT_LOCATION_KIND_RACK;
+  if(streq(type, "row"))
+    return AMBIENT_LOCATION_KIND_ROW;
+  return AMBIENT_LOCATION_KIND_OTHER;
+}
 
-  char *aux_log = NULL;
-  asprintf(&aux_log, "%s@%s (value: %s%s, ttl: %u)",
-     fty_proto_type(n_met),
-     fty_proto_name(n_met),
-     fty_proto_value(n_met),
-     fty_proto_unit(n_met),
-     fty_proto_ttl(n_met)
-  );
+static ambient_function_t s_sensor_function(const char *function) {
+  if(streq(function, "input"))
+    return AMBIENT_FUNCTION_INPUT;
+  if(streq(function, "output"))
+    return AMBIENT_FUNCTION_OUTPUT;
+  return AMBIENT_FUNCTION_NONE;
+}
 
-  int rv = fty::shm::write_metric(n_met);
-  if (rv != 0) {
-    log_error (ANSI_COLOR_RED "SHM publish failed (%s)" ANSI_COLOR_RESET, aux_log);
-  }
-  else {
-      log_debug(ANSI_COLOR_YELLOW "SHM publish %s" ANSI_COLOR_RESET, aux_log);
+//store the metric in the slot, return false if its value is not a number
+static bool s_update_cache_slot(ambient_slot_t& slot, const std::string& sensor_name, const char *value,
+  uint32_t ttl, uint64_t time) {
+  char *end;
+  errno = 0;
+  double dvalue = strtod (value, &end);
+
+  if (errno == ERANGE || end == value || *end != '\0') {
+    log_info ("cannot convert value '%s' of %s to double, ignore message\n", value, sensor_name.c_str ());
+    slot.valid = false;
+    return false;
   }
-  zstr_free(&aux_log);
-  fty_proto_destroy(&n_met);
+  slot.value = dvalue;
+  slot.ttl = ttl;
+  slot.valid_till = time + slot.ttl;
+  slot.valid = true;
+  return true;
 }
 
-//return false if name is not a sensor
-static bool s_get_cache_value(AmbientLocation* self, std::string name, int typeMetric, ambient_values_t& result) {
-  auto sensor = self->cache.find(name);
-  if(sensor == self->cache.end()) {
-    return false;
+//return the id of name, making room for it in the per asset table
+static asset_id_t s_intern(AmbientLocation* self, const std::string& name) {
+  asset_id_t id = self->topology.intern(name);
+  if(self->topology.size() > self->assets.size()) {
+    self->assets.resize(self->topology.size());
+    self->sensor_devices.resize(self->topology.size());
   }
+  return id;
+}
 
-  //it's a sensor
-  fty_proto_t *sensor_value = NULL;
-  if(typeMetric == AMBIENT_LOCATION_TYPE_HUMIDITY) {
-    sensor_value = sensor->second.second.first;
-  } else {
-    sensor_value = sensor->second.second.second;
+//write a value in shm, stamped with time (virtual in simulation, so that
+//replays give the same output)
+static int s_publish_value(const char *type, const char *unit, const char *name, double value, int ttl, time_t time) {
+  char value_s[32];
+  snprintf(value_s, sizeof(value_s), "%.2f", value);
+
+  fty_proto_t *metric = fty_proto_new(FTY_PROTO_METRIC);
+  fty_proto_set_name(metric, "%s", name);
+  fty_proto_set_type(metric, "%s", type);
+  fty_proto_set_value(metric, "%s", value_s);
+  fty_proto_set_unit(metric, "%s", unit);
+  fty_proto_set_ttl(metric, ttl);
+  fty_proto_set_time(metric, time);
+  int rv = fty::shm::write_metric(metric);
+  fty_proto_destroy(&metric);
+  if (rv != 0) {
+    log_error (ANSI_COLOR_RED "SHM publish failed (%s@%s (value: %s%s, ttl: %d))" ANSI_COLOR_RESET, type, name, value_s, unit, ttl);
   }
+  else {
+      log_debug(ANSI_COLOR_YELLOW "SHM publish %s@%s (value: %s%s, ttl: %d)" ANSI_COLOR_RESET, type, name, value_s, unit, ttl);
+  }
+  return rv;
+}
 
-  if(sensor_value == NULL) {
-   //no metric in cache
-   return true;
+//queue an average of a location for publication, unless it did not move
+//more than the deadband since it was written and is not close to expire
+static void s_queue_value(AmbientLocation* self, ambient_compute_t& computed, ambient_location_node_t& node, asset_id_t id, ambient_output_t output, double value, int ttl, time_t now) {
+  ambient_published_t &published = node.published[output];
+  time_t refresh_at = published.time + ttl * self->refresh / 100;
+  if(published.time != 0 && now < refresh_at && std::fabs(value - published.value) <= self->deadband) {
+    computed.suppressed++;
   }
-  time_t valid_till = fty_proto_time(sensor_value)+fty_proto_ttl(sensor_value);
-  if(time(NULL) > valid_till) {
-    //the metric is too old
-    s_remove_from_cache(self, name, typeMetric);
-    return true;
+  else {
+    ambient_publication_t publication = { id, output, value, ttl, node.ingested };
+    computed.publications.push_back(publication);
+    published.value = value;
+    published.time = now;
+    refresh_at = now + ttl * self->refresh / 100;
   }
+  //come back to this location in time to refresh it
+  if(refresh_at < node.refresh_at)
+    node.refresh_at = refresh_at;
+}
 
-  //we have a valid metric, get the data
-  const char *value = fty_proto_value(sensor_value);
-  char *end;
-  errno = 0;
-  double dvalue = strtod (value, &end);
+//write the averages queued during the cycle, once it is over. fty-shm has
+//no batch write, so this is still one write (one file) per average; the
+//batch only keeps them out of the computation. An average which could not
+//be written is forgotten, so the next cycle writes it again whatever the
+//deadband.
+static void s_flush_values(AmbientLocation* self) {
+  uint64_t written = self->publish_stats.written;
+  uint64_t failed = self->publish_stats.failed;
+  int64_t now = self->clock->mono();
+  time_t time = self->clock->now();
+  for (auto &publication : self->computed.publications) {
+    int64_t ingested = publication.ingested;
+    if(ingested != 0)
+      self->publish_latency.record(now > ingested ? now - ingested : 0);
+    int rv = s_publish_value(s_outputs[publication.output].type, s_outputs[publication.output].unit,
+      self->snapshot->hierarchy.name(publication.id).c_str(), publication.value, publication.ttl, time);
+    if(rv == 0)
+      self->publish_stats.written++;
+    else {
+      self->publish_stats.failed++;
+      self->locations[publication.id].published[publication.output].time = 0;
+      s_mark_dirty(self, publication.id);
+    }
+  }
+  self->stats.add(AMBIENT_STAT_SHM_WRITES, self->publish_stats.written - written);
+  self->stats.add(AMBIENT_STAT_SHM_FAILURES, self->publish_stats.failed - failed);
+  self->computed.publications.clear();
+}
 
-  if (errno == ERANGE || end == value || *end != '\0') {
-    log_info ("cannot convert value '%s' to double, ignore message\n", value);
-    fty_proto_print (sensor_value);
-    return true;
+//return false if id is not a sensor
+static bool s_get_cache_value(AmbientLocation* self, asset_id_t id, int typeMetric, ambient_values_t& result) {
+  const ambient_asset_t &asset = self->snapshot->assets[id];
+  if(!asset.sensor) {
+    return false;
   }
+  ambient_sensor_t &sensor = self->cache[id];
+  ambient_function_t function = asset.function;
 
-  std::string function = sensor->second.first;
-  //std::string type = fty_proto_type(sensor_value);
+  //it's a sensor
+  ambient_slot_t &slot = s_cache_slot(sensor, typeMetric);
+  if(!slot.valid) {
+   //no metric in cache, or too old
+   return true;
+  }
 
+  //we have a valid metric, get the data
+  ambient_value_t *value = NULL;
   if(typeMetric == AMBIENT_LOCATION_TYPE_HUMIDITY) {
-    if(function == "input") {
-      result.in_humidity.value = dvalue;
-      result.in_humidity.ttl = fty_proto_ttl(sensor_value);
-    } else if(function == "output") {
-      result.out_humidity.value = dvalue;
-      result.out_humidity.ttl = fty_proto_ttl(sensor_value);
-    }
+    if(function == AMBIENT_FUNCTION_INPUT)
+      value = &result.in_humidity;
+    else if(function == AMBIENT_FUNCTION_OUTPUT)
+      value = &result.out_humidity;
   }
   else {
-    if(function == "input") {
-      result.in_temperature.value = dvalue;
-      result.in_temperature.ttl = fty_proto_ttl(sensor_value);
-    } else if(function == "output") {
-      result.out_temperature.value = dvalue;
-      result.out_temperature.ttl = fty_proto_ttl(sensor_value);
-    }
+    if(function == AMBIENT_FUNCTION_INPUT)
+      value = &result.in_temperature;
+    else if(function == AMBIENT_FUNCTION_OUTPUT)
+      value = &result.out_temperature;
+  }
+  if(value) {
+    value->value = slot.value;
+    value->ttl = slot.ttl;
   }
   return true;
 }
 
-static ambient_values_t s_compute_values (AmbientLocation* self, std::string name) {
-  ambient_values_t result;
+static void s_reset_values (ambient_values_t& result) {
   result.in_humidity.value = NaN;
   result.out_humidity.value = NaN;
   result.in_temperature.value = NaN;
@@ -270,18 +547,47 @@ static ambient_values_t s_compute_values (AmbientLocation* self, std::string nam
   result.out_humidity.ttl = 0;
   result.in_temperature.ttl = 0;
   result.out_temperature.ttl = 0;
-  //if name is a sensor, both humidity and temperature will see it as it is even if we don't have data in both
-  if(s_get_cache_value(self, name, AMBIENT_LOCATION_TYPE_HUMIDITY, result)) {
-    s_get_cache_value(self, name, AMBIENT_LOCATION_TYPE_TEMP, result);
+}
+
+//mark id and all its known ancestors as dirty, so the next calculation
+//recomputes (and republishes) them. A dirty node always has dirty ancestors,
+//so we can stop as soon as we reach one.
+static void s_mark_dirty (AmbientLocation* self, asset_id_t id) {
+  //at most every node, were a cycle to get past the topology
+  size_t steps = self->snapshot->hierarchy.size();
+  asset_id_t current = id;
+  while (current != AmbientTopology::NONE && steps-- > 0) {
+    ambient_location_node_t &node = self->locations[current];
+    if (node.dirty && current != id)
+      break;
+    node.dirty = true;
+    current = self->snapshot->hierarchy.parent(current);
+  }
+}
+
+//return the values of id as seen by its parent; locations are recomputed
+//(and published) only if dirty
+static ambient_values_t s_compute_values (AmbientLocation* self, ambient_compute_t& computed, asset_id_t id, time_t now) {
+  ambient_values_t result;
+  s_reset_values(result);
+  //if id is a sensor, both humidity and temperature will see it as it is even if we don't have data in both
+  if(s_get_cache_value(self, id, AMBIENT_LOCATION_TYPE_HUMIDITY, result)) {
+    s_get_cache_value(self, id, AMBIENT_LOCATION_TYPE_TEMP, result);
     return result;
   }
 
   //not a sensor, must be a location
-  if(self->m_list_contents.count(name) == 0) {
-    //should not happend
-    return result;
+  ambient_location_node_t &node = self->locations[id];
+  if(!node.dirty) {
+    //nothing changed below this location since last computation
+    return node.result;
   }
-  std::vector<std::string> content_list = self->m_list_contents.at(name);
+  node.dirty = false;
+  node.refresh_at = AMBIENT_LOCATION_NEVER_EXPIRE;
+  node.result = result;
+  computed.recomputed.push_back(id);
+
+  const ambient_publish_policy_t &policy = s_publish_policy[self->snapshot->assets[id].kind];
   int outtemp_n = 0;
   int outhum_n = 0;
   int intemp_n = 0;
@@ -290,8 +596,10 @@ static ambient_values_t s_compute_values (AmbientLocation* self, std::string nam
   result.out_temperature.value = 0;
   result.in_humidity.value = 0;
   result.out_humidity.value = 0;
-  for (auto &content : content_list) {
-    ambient_values_t result_temp = s_compute_values(self, content);
+  const AmbientHierarchy &hierarchy = self->snapshot->hierarchy;
+  const asset_id_t *end = hierarchy.children_end(id);
+  for (const asset_id_t *content = hierarchy.children_begin(id); content != end; content++) {
+    ambient_values_t result_temp = s_compute_values(self, computed, *content, now);
     if(!std::isnan(result_temp.out_temperature.value)) {
       outtemp_n++;
       result.out_temperature.value += result_temp.out_temperature.value;
@@ -318,35 +626,35 @@ static ambient_values_t s_compute_values (AmbientLocation* self, std::string nam
     result.out_temperature.value = NaN;
   } else {
     result.out_temperature.value = result.out_temperature.value / outtemp_n;
-    if(name.find("rack") != std::string::npos || name.find("row") != std::string::npos)
-      s_publish_value("average.temperature-output", "C", name,result.out_temperature.value, result.out_temperature.ttl);
+    if(policy.per_function)
+      s_queue_value(self, computed, node, id, AMBIENT_OUTPUT_TEMPERATURE_OUTPUT, result.out_temperature.value, result.out_temperature.ttl, now);
   }
 
   if(outhum_n == 0) {
     result.out_humidity.value = NaN;
   } else {
     result.out_humidity.value = result.out_humidity.value / outhum_n;
-    if(name.find("rack") != std::string::npos || name.find("row") != std::string::npos)
-      s_publish_value("average.humidity-output", "%", name,result.out_humidity.value, result.out_humidity.ttl);
+    if(policy.per_function)
+      s_queue_value(self, computed, node, id, AMBIENT_OUTPUT_HUMIDITY_OUTPUT, result.out_humidity.value, result.out_humidity.ttl, now);
   }
 
   if(intemp_n == 0) {
     result.in_temperature.value = NaN;
   } else {
     result.in_temperature.value = result.in_temperature.value / intemp_n;
-    if(name.find("rack") != std::string::npos || name.find("row") != std::string::npos)
-      s_publish_value("average.temperature-input", "C", name,result.in_temperature.value, result.in_temperature.ttl);
+    if(policy.per_function)
+      s_queue_value(self, computed, node, id, AMBIENT_OUTPUT_TEMPERATURE_INPUT, result.in_temperature.value, result.in_temperature.ttl, now);
   }
 
   if(inhum_n == 0) {
     result.in_humidity.value = NaN;
   } else {
     result.in_humidity.value = result.in_humidity.value / inhum_n;
-    if(name.find("rack") != std::string::npos || name.find("row") != std::string::npos)
-      s_publish_value("average.humidity-input", "%", name,result.in_humidity.value, result.in_humidity.ttl);
+    if(policy.per_function)
+      s_queue_value(self, computed, node, id, AMBIENT_OUTPUT_HUMIDITY_INPUT, result.in_humidity.value, result.in_humidity.ttl, now);
   }
 
-  if(name.find("rack") == std::string::npos)
+  if(policy.global)
   {
     double humidity = 0;
     double temperature = 0;
@@ -377,142 +685,371 @@ static ambient_values_t s_compute_values (AmbientLocation* self, std::string nam
       result.out_humidity.value = NaN;
     else {
       result.out_humidity.value = humidity/n_humidity;
-      s_publish_value("average.humidity", "%", name,result.out_humidity.value, result.out_humidity.ttl);
+      s_queue_value(self, computed, node, id, AMBIENT_OUTPUT_HUMIDITY, result.out_humidity.value, result.out_humidity.ttl, now);
     }
 
     if(temperature == 0)
       result.out_temperature.value = NaN;
     else {
       result.out_temperature.value = temperature/n_temperature;
-      s_publish_value("average.temperature", "C", name,result.out_temperature.value, result.out_temperature.ttl);
+      s_queue_value(self, computed, node, id, AMBIENT_OUTPUT_TEMPERATURE, result.out_temperature.value, result.out_temperature.ttl, now);
     }
   }
 
+  node.result = result;
   return result;
 }
 
+//what the topology file keeps of an asset
+static uint32_t s_asset_attributes (const ambient_asset_t& asset) {
+  return uint32_t(asset.sensor) | uint32_t(asset.function) << 1 | uint32_t(asset.kind) << 3;
+}
+
+static ambient_asset_t s_asset_from_attributes (uint32_t attributes) {
+  ambient_asset_t asset = ambient_asset_t();
+  asset.sensor = attributes & 1;
+  asset.function = ambient_function_t((attributes >> 1) & 3);
+  asset.kind = ambient_location_kind_t((attributes >> 3) & 3);
+  return asset;
+}
+
+//the topology file is left alone in simulation: a replay must depend on
+//its recording only, and not overwrite the file of the live agent
+static void s_save_topology (AmbientLocation* self) {
+  if(self->topology_path.empty() || self->simulation)
+    return;
+  std::vector<uint32_t> attributes(self->assets.size());
+  for (asset_id_t id = 0; id < self->assets.size(); id++)
+    attributes[id] = s_asset_attributes(self->assets[id]);
+  AmbientStore::save_topology(self->topology_path.c_str(), self->topology, attributes);
+}
+
+//record a change of the topology, id (if any) and its ancestors will be
+//recomputed once the calculation sees a version carrying it
+static void s_topology_change (AmbientLocation* self, asset_id_t id) {
+  if(id != AmbientTopology::NONE) {
+    ambient_topology_change_t change = { id, 0 };
+    self->changes.push_back(change);
+  }
+  if(!self->topology_changed) {
+    self->topology_changed = true;
+    self->topology_changed_since = self->clock->mono();
+  }
+}
+
+//build a new immutable version of the topology and hand it over to the
+//calculation, which keeps using the previous one until its next cycle
+static void s_publish_topology (AmbientLocation* self) {
+  auto version = std::make_shared<ambient_topology_version_t>();
+  version->version = ++self->topology_version;
+  self->topology.compile(version->hierarchy);
+  version->assets = self->assets;
+
+  //forget the changes carried by a version the calculation already loaded,
+  //it may skip versions so newer ones keep carrying the others
+  uint64_t consumed = self->topology_consumed.load();
+  size_t kept = 0;
+  for (auto &change : self->changes) {
+    if(change.version != 0 && change.version <= consumed)
+      continue;
+    if(change.version == 0)
+      change.version = version->version;
+    version->changes.push_back(change.id);
+    self->changes[kept++] = change;
+  }
+  self->changes.resize(kept);
+
+  std::atomic_store(&self->topology_published, std::shared_ptr<const ambient_topology_version_t>(version));
+  self->topology_changed = false;
+  s_save_topology(self);
+  if(self->metrics_consumer)
+    self->subscription_changed = true;
+
+  size_t sensors = 0;
+  for (asset_id_t id = 0; id < version->assets.size(); id++) {
+    if(version->assets[id].sensor && self->topology.parent(id) != AmbientTopology::NONE)
+      sensors++;
+  }
+  self->stats.set(AMBIENT_STAT_TOPOLOGY_VERSION, version->version);
+  self->stats.set(AMBIENT_STAT_TOPOLOGY_NODES, version->hierarchy.size());
+  self->stats.set(AMBIENT_STAT_TOPOLOGY_SENSORS, sensors);
+  self->stats.set(AMBIENT_STAT_TOPOLOGY_DATACENTERS, self->topology.datacenters().size());
+  log_debug("Topology version %" PRIu64 " published (%zu assets, %zu changes)",
+    version->version, version->hierarchy.size(), version->changes.size());
+}
+
+static int
+s_remove_asset (AmbientLocation* self, asset_id_t id)
+{
+  bool removed = false;
+  if(self->topology.remove_datacenter(id)) {
+    s_topology_change(self, AmbientTopology::NONE);
+    removed = true;
+  }
+  asset_id_t parent = self->topology.parent(id);
+  if(self->topology.detach(id)) {
+    s_topology_change(self, parent);
+    removed = true;
+  }
+  return removed ? 0 : -1;
+}
+
+//load the topology saved by a previous run, its assets stay unconfirmed
+//until the answer to REPUBLISH mentions them
+static void s_load_topology (AmbientLocation* self) {
+  if(self->topology_path.empty() || self->simulation || self->topology.size() != 0)
+    return;
+  int64_t start = zclock_usecs();
+  std::vector<uint32_t> attributes;
+  if(AmbientStore::load_topology(self->topology_path.c_str(), self->topology, attributes) != 0)
+    return;
+  self->assets.resize(attributes.size());
+  self->sensor_devices.resize(attributes.size());
+  for (asset_id_t id = 0; id < attributes.size(); id++)
+    self->assets[id] = s_asset_from_attributes(attributes[id]);
+  self->topology_confirmed.assign(self->topology.size(), false);
+  s_topology_change(self, AmbientTopology::NONE);
+  s_publish_topology(self);
+  log_info("Topology loaded from %s (%zu assets in %" PRId64 " us)", self->topology_path.c_str(),
+    self->topology.size(), zclock_usecs() - start);
+}
+
 static int
 s_remove_asset (AmbientLocation* self, fty_proto_t *bmsg)
 {
   log_debug("REMOVE ASSET");
-  if(streq (fty_proto_aux_string(bmsg, FTY_PROTO_ASSET_TYPE, ""), "datacenter")) {
-    for(unsigned int i=0; i < self->datacenters.size(); i++) {
-      if(self->datacenters[i] == fty_proto_name(bmsg)) {
-        self->datacenters.erase(self->datacenters.begin()+i);
-        return 0;
-      }
-    }
-    return -1;
-  }
-  auto val = self->containers.find(fty_proto_name(bmsg));
-  if( val == self->containers.end()) {
+  asset_id_t id = self->topology.find(fty_proto_name(bmsg));
+  if(id == AmbientTopology::NONE) {
     //We don't know this asset
     return -1;
   }
-  auto got_list = self->m_list_contents.find(val->second);
-  //for safety reason, should always happened.
-  if( got_list != self->m_list_contents.end()) {
-    for(unsigned int i = 0; i< got_list->second.size(); i++) {
-      if(got_list->second[i] == fty_proto_name(bmsg)) {
-        got_list->second.erase(got_list->second.begin()+i);
-        return 0;
-      }
-    }
-  }
-  return -1;
+  return s_remove_asset(self, id);
 }
 
+//create the asset, or move it in a single step if it is known already
 static int
 s_create_asset (AmbientLocation* self, fty_proto_t *bmsg)
 {
   log_debug("CREATE ASSET");
   if(streq (fty_proto_aux_string (bmsg, FTY_PROTO_ASSET_TYPE, ""), "datacenter")) {
-    self->datacenters.push_back(fty_proto_name(bmsg));
+    asset_id_t id = s_intern(self, fty_proto_name(bmsg));
+    asset_id_t parent = self->topology.parent(id);
+    if(self->topology.detach(id))
+      s_topology_change(self, parent);
+    if(self->topology.add_datacenter(id))
+      s_topology_change(self, id);
     return 0;
   }
-  std::string parent;
+  const char *parent;
   if(streq (fty_proto_aux_string (bmsg, FTY_PROTO_ASSET_SUBTYPE, ""), "sensor" )) {
     parent = fty_proto_ext_string (bmsg, "logical_asset", "");
   } else {
     parent = fty_proto_aux_string(bmsg, "parent_name.1", "");
   }
   //should never happened
-  if(parent == "")
+  if(streq (parent, "")) {
+    asset_id_t id = self->topology.find(fty_proto_name(bmsg));
+    if(id != AmbientTopology::NONE)
+      s_remove_asset(self, id);
     return -1;
+  }
 
-  self->containers[fty_proto_name(bmsg)] = parent;
+  asset_id_t id = s_intern(self, fty_proto_name(bmsg));
+  asset_id_t parent_id = s_intern(self, parent);
+  asset_id_t previous = self->topology.attach(id, parent_id);
+  if(previous == id) {
+    log_error("%s cannot be moved below %s, one of its descendants", fty_proto_name(bmsg), parent);
+    return -1;
+  }
+  if(self->topology.remove_datacenter(id))
+    s_topology_change(self, AmbientTopology::NONE);
+  if(previous != parent_id) {
+    if(previous != AmbientTopology::NONE)
+      s_topology_change(self, previous);
+    s_topology_change(self, parent_id);
+  }
 
-  auto got_list = self->m_list_contents.find(parent);
-  if(got_list == self->m_list_contents.end()) {
-    std::vector<std::string> new_list(1, fty_proto_name(bmsg));
-    self->m_list_contents[parent] = new_list;
-  } else {
-    got_list->second.push_back(fty_proto_name(bmsg));
+  ambient_location_kind_t kind = s_location_kind(fty_proto_aux_string (bmsg, FTY_PROTO_ASSET_TYPE, ""));
+  if(self->assets[id].kind != kind) {
+    self->assets[id].kind = kind;
+    s_topology_change(self, id);
   }
 
   return 0;
 }
 
+//take mtx_ambient_hashmap, accounting for the time waited when the other
+//actor holds it; an uncontended lock costs no clock read
+static std::unique_lock<std::mutex> s_lock_updates (AmbientLocation* self) {
+  std::unique_lock<std::mutex> lock(mtx_ambient_hashmap, std::try_to_lock);
+  if(!lock.owns_lock()) {
+    int64_t start = zclock_usecs();
+    lock.lock();
+    self->stats.add(AMBIENT_STAT_LOCK_CONTENDED);
+    self->stats.add(AMBIENT_STAT_LOCK_WAIT_US, zclock_usecs() - start);
+  }
+  return lock;
+}
 
+//keep the latest value of each sensor and type until the batch is flushed,
+//along with the oldest ingest it replaced
 static void
-s_ambloc_actor_stream (AmbientLocation* self, zmsg_t **message_p)
+s_queue_update (AmbientLocation* self, const ambient_sensor_update_t& update, const char *unit)
 {
-  //log_debug("s_ambloc_actor_stream");
+  size_t key = size_t(update.id) * 2 + update.type;
+  if(key >= self->pending_index.size())
+    self->pending_index.resize(self->topology.size() * 2, 0);
+  uint32_t &position = self->pending_index[key];
+  if(position == 0) {
+    self->pending.push_back(update);
+    position = self->pending.size();
+    if(self->pending_units.size() < self->pending.size())
+      self->pending_units.resize(self->pending.size());
+  }
+  else {
+    ambient_sensor_update_t &queued = self->pending[position - 1];
+    int64_t ingested = queued.ingested;
+    queued = update;
+    queued.ingested = ingested;
+    self->stats.add(AMBIENT_STAT_METRICS_COALESCED);
+  }
+  self->pending_units[position - 1].assign(unit);
+}
 
-  fty_proto_t *bmsg = fty_proto_decode (message_p);
-  if (!bmsg) {
-      log_error("Get a stream message that is not fty_proto typed");
-      return;
+//store a sensor metric, whether it was decoded in place or by fty_proto
+static void
+s_ingest_metric (AmbientLocation* self, const std::string& sensor_name, const char *type, const char *value,
+  const char *unit, uint32_t ttl, uint64_t time)
+{
+  self->stats.add(AMBIENT_STAT_METRICS_RECEIVED);
+
+  log_debug("METRIC SENSOR message (asset: %s, type: %s)", sensor_name.c_str(), type);
+
+  int typeMetric = -1;
+  if(strstr(type, "humidity"))
+    typeMetric = AMBIENT_LOCATION_TYPE_HUMIDITY;
+  else if(strstr(type, "temperature"))
+    typeMetric = AMBIENT_LOCATION_TYPE_TEMP;
+
+  bool metric_in_cache = false;
+  ambient_sensor_update_t update = ambient_sensor_update_t ();
+  update.type = typeMetric;
+
+  if(typeMetric != -1) {
+    update.id = self->topology.find(sensor_name);
+    if(update.id != AmbientTopology::NONE && self->assets[update.id].sensor) {
+      metric_in_cache = s_update_cache_slot(update.slot, sensor_name, value, ttl, time);
+      if(metric_in_cache) {
+        int64_t delay = self->clock->now_ms() - int64_t(time) * 1000;
+        self->sensor_latency.record(delay > 0 ? delay : 0);
+      }
+      update.ingested = self->clock->mono();
+      s_queue_update(self, update, unit);
     }
+  }
+  self->stats.add(metric_in_cache ? AMBIENT_STAT_CACHE_UPDATES : AMBIENT_STAT_METRICS_IGNORED);
+}
 
-  if (streq (mlm_client_address (self->client), FTY_PROTO_STREAM_METRICS_SENSOR)) {
+//hand the sensor values of the batch over to the calculation under a single
+//lock, then copy them in shm
+static void
+s_flush_updates (AmbientLocation* self)
+{
+  if(self->pending.empty())
+    return;
+  bool first;
+  {
+    std::unique_lock<std::mutex> lock = s_lock_updates(self);
+    first = self->updates.empty();
+    self->updates.insert(self->updates.end(), self->pending.begin(), self->pending.end());
+  }
+  //event-driven mode, the calculation is woken once per batch
+  if(self->debounce_ms > 0 && !self->simulation && self->ambient_calculation) {
+    self->updates_last.store(self->clock->mono(), std::memory_order_relaxed);
+    if(first)
+      zstr_send(self->ambient_calculation, "UPDATE");
+  }
+
+  for (size_t i = 0; i < self->pending.size(); i++) {
+    const ambient_sensor_update_t &update = self->pending[i];
+    self->pending_index[size_t(update.id) * 2 + update.type] = 0;
+    // PQSWMBT-3723: if sensor metric is handled, publish it in shared memory.
+    // metric (or quantity) ex.: 'humidity.default@sensor-241', 'temperature.default@sensor-372'
+    if (update.slot.valid) {
+      // here, sensor metric type is like 'temperature.N' or 'humidity.N'
+      // where N is the index (offset 0) related to its device owner (edpu, ups).
+      // we normalize the metric quantity to 'default'.
+      const char *quantity = update.type == AMBIENT_LOCATION_TYPE_TEMP ? "temperature.default" : "humidity.default";
+      int rv = s_publish_value(quantity, self->pending_units[i].c_str(), self->topology.name(update.id).c_str(),
+        update.slot.value, update.slot.ttl, self->clock->now());
+      self->stats.add(rv == 0 ? AMBIENT_STAT_SHM_WRITES : AMBIENT_STAT_SHM_FAILURES);
+    }
+    // end PQSWMBT-3723
+  }
+  self->pending.clear();
+}
 
-    std::string sensor_name = fty_proto_aux_string(bmsg, "sname", "");
-    std::string type = fty_proto_type(bmsg);
+//read the temperatures and humidities of the sensors in shm, those of other
+//assets and those which did not change since the last read are skipped.
+//Only temperature.N/humidity.N: the *.default copies s_flush_updates writes
+//would take the same seen slot and alternate with them.
+static void
+s_ingest_shm (AmbientLocation* self)
+{
+  int64_t start = zclock_usecs();
+  fty::shm::shmMetrics metrics;
+  if(fty::shm::read_metrics(".*", "^(temperature|humidity)\\.[0-9]+$", metrics) != 0) {
+    log_error("Failed to read the sensor metrics in shm");
+    return;
+  }
+  if(self->shm_seen.size() < self->topology.size() * 2)
+    self->shm_seen.resize(self->topology.size() * 2);
+  for (fty_proto_t *metric : metrics) {
+    asset_id_t id = self->topology.find(fty_proto_name(metric));
+    if(id == AmbientTopology::NONE || !self->assets[id].sensor)
+      continue;
+    const char *type = fty_proto_type(metric);
+    ambient_shm_seen_t &seen = self->shm_seen[size_t(id) * 2 + (strstr(type, "humidity") ? AMBIENT_LOCATION_TYPE_HUMIDITY : AMBIENT_LOCATION_TYPE_TEMP)];
+    if(seen.time == fty_proto_time(metric) && seen.value == fty_proto_value(metric))
+      continue;
+    seen.time = fty_proto_time(metric);
+    seen.value.assign(fty_proto_value(metric));
+    s_ingest_metric(self, self->topology.name(id), type, fty_proto_value(metric), fty_proto_unit(metric),
+      fty_proto_ttl(metric), fty_proto_time(metric));
+  }
+  self->stats.add(AMBIENT_STAT_INGEST_READS);
+  self->stats.set(AMBIENT_STAT_INGEST_READ_US, zclock_usecs() - start);
+}
 
-    log_debug("METRIC SENSOR message (asset: %s, type: %s)", sensor_name.c_str(), type.c_str());
+static void
+s_ambloc_actor_stream (AmbientLocation* self, const char *stream, zmsg_t **message_p)
+{
+  //log_debug("s_ambloc_actor_stream");
 
-    bool metric_in_cache = false;
+  //sensor metrics are read straight from their frame, anything else goes
+  //through the full decoder
+  if (streq (stream, FTY_PROTO_STREAM_METRICS_SENSOR) && self->metric.decode (*message_p) == 0) {
+    s_ingest_metric (self, self->metric.sname (), self->metric.type ().c_str (), self->metric.value ().c_str (),
+      self->metric.unit ().c_str (), self->metric.ttl (), self->metric.time ());
+    zmsg_destroy (message_p);
+    return;
+  }
 
-    mtx_ambient_hashmap.lock();
-    if(self->cache.count(sensor_name) != 0) {
-      if(type.find("humidity") != std::string::npos) {
-        s_remove_from_cache(self,sensor_name, AMBIENT_LOCATION_TYPE_HUMIDITY);
-        self->cache.at(sensor_name).second.first = fty_proto_dup(bmsg);
-        metric_in_cache = true;
-      }
-      else if(type.find("temperature") != std::string::npos) {
-        s_remove_from_cache(self,sensor_name, AMBIENT_LOCATION_TYPE_TEMP);
-        self->cache.at(sensor_name).second.second = fty_proto_dup(bmsg);
-        metric_in_cache = true;
-      }
+  fty_proto_t *bmsg = fty_proto_decode (message_p);
+  if (!bmsg) {
+      log_error("Get a stream message that is not fty_proto typed");
+      self->stats.add(AMBIENT_STAT_MESSAGES_IGNORED);
+      return;
     }
-    mtx_ambient_hashmap.unlock();
 
-    // PQSWMBT-3723: if sensor metric is handled, publish it in shared memory.
-    // metric (or quantity) ex.: 'humidity.default@sensor-241', 'temperature.default@sensor-372'
-    if (metric_in_cache) {
-      const char *value_s = fty_proto_value(bmsg);
-      double value;
-      int r = sscanf((value_s ? value_s : ""), "%lf", &value);
-      if (r == 1) {
-          // here, sensor metric type is like 'temperature.N' or 'humidity.N'
-          // where N is the index (offset 0) related to its device owner (edpu, ups).
-          // we normalize the metric quantity to 'default'.
-          const char *quantity = NULL;
-          if (type.find("temperature") != std::string::npos)
-            quantity = "temperature.default";
-          else if (type.find("humidity") != std::string::npos)
-            quantity = "humidity.default";
-          if (quantity)
-            s_publish_value(quantity, fty_proto_unit(bmsg), sensor_name.c_str(), value, fty_proto_ttl(bmsg));
-      }
-    }
-    // end PQSWMBT-3723
+  if (streq (stream, FTY_PROTO_STREAM_METRICS_SENSOR)) {
+    s_ingest_metric (self, fty_proto_aux_string(bmsg, "sname", ""), fty_proto_type(bmsg), fty_proto_value(bmsg),
+      fty_proto_unit(bmsg), fty_proto_ttl(bmsg), fty_proto_time(bmsg));
   }
   else if (fty_proto_id (bmsg) == FTY_PROTO_ASSET) {
 
     log_debug("PROTO ASSET message");
+    self->stats.add(AMBIENT_STAT_ASSETS_RECEIVED);
 
     if(streq (fty_proto_aux_string (bmsg, FTY_PROTO_ASSET_TYPE, ""), "device" )
                      && !streq (fty_proto_aux_string (bmsg, FTY_PROTO_ASSET_SUBTYPE, ""), "sensor" )) {
@@ -521,12 +1058,18 @@ s_ambloc_actor_stream (AmbientLocation* self, zmsg_t **message_p)
         fty_proto_name (bmsg),
         fty_proto_aux_string (bmsg, FTY_PROTO_ASSET_TYPE, "")
       );
+      self->stats.add(AMBIENT_STAT_ASSETS_IGNORED);
 
       fty_proto_destroy (&bmsg);
       return;
     }
 
-    mtx_ambient_hashmap.lock();
+    if (!self->topology_confirmed.empty ()) {
+      asset_id_t id = self->topology.find (fty_proto_name (bmsg));
+      if (id < self->topology_confirmed.size ())
+        self->topology_confirmed[id] = true;
+    }
+
     if (streq (fty_proto_operation (bmsg), FTY_PROTO_ASSET_OP_DELETE)
                      || streq (fty_proto_aux_string (bmsg, FTY_PROTO_ASSET_STATUS, "active"), "inactive")
                      || streq (fty_proto_aux_string (bmsg, FTY_PROTO_ASSET_STATUS, "active"), "retired")) {
@@ -534,28 +1077,290 @@ s_ambloc_actor_stream (AmbientLocation* self, zmsg_t **message_p)
     }
     else if (streq (fty_proto_operation (bmsg), FTY_PROTO_ASSET_OP_CREATE)
                      || streq (fty_proto_operation (bmsg), FTY_PROTO_ASSET_OP_UPDATE)) {
-      s_remove_asset (self, bmsg);
       int ret = s_create_asset (self, bmsg);
       if(ret != -1 && streq (fty_proto_aux_string (bmsg, FTY_PROTO_ASSET_SUBTYPE, ""), "sensor" )) {
-        auto sensor = self->cache.find(fty_proto_name(bmsg));
-        if(sensor != self->cache.end()) {
-          sensor->second.first = fty_proto_ext_string(bmsg, "sensor_function", "");
-        } else {
-          self->cache[fty_proto_name(bmsg)];
-          self->cache.at(fty_proto_name(bmsg)).first = fty_proto_ext_string(bmsg, "sensor_function", "");
-          self->cache.at(fty_proto_name(bmsg)).second.first = NULL;
-          self->cache.at(fty_proto_name(bmsg)).second.second = NULL;
+        asset_id_t id = self->topology.find(fty_proto_name(bmsg));
+        ambient_asset_t &sensor = self->assets[id];
+        ambient_function_t function = s_sensor_function(fty_proto_ext_string(bmsg, "sensor_function", ""));
+        if(!sensor.sensor || sensor.function != function) {
+          sensor.sensor = true;
+          sensor.function = function;
+          s_topology_change(self, self->topology.parent(id));
+        }
+        //the device it is plugged into, which names its metrics
+        const char *device = fty_proto_aux_string(bmsg, "parent_name.1", "");
+        if(self->sensor_devices[id] != device) {
+          self->sensor_devices[id] = device;
+          s_topology_change(self, AmbientTopology::NONE);
         }
       }
     }
-    mtx_ambient_hashmap.unlock();
   }
   else {
-    log_debug("Get a stream message from %s (unhandled)", mlm_client_address (self->client));
+    log_debug("Get a stream message from %s (unhandled)", stream);
+    self->stats.add(AMBIENT_STAT_MESSAGES_IGNORED);
   }
   fty_proto_destroy (&bmsg);
 }
 
+static uint64_t s_timer_key (asset_id_t id, int kind) {
+  return (uint64_t(id) << 2) | kind;
+}
+
+//make sure a timer fires for key at deadline. There is at most one pending
+//timer per key (scheduled), a later deadline is rescheduled when it fires.
+static void s_schedule (AmbientLocation* self, time_t& scheduled, time_t deadline, uint64_t key) {
+  if(scheduled != 0 && scheduled <= deadline)
+    return;
+  scheduled = deadline;
+  self->expiry.schedule(deadline, key);
+}
+
+//fire the timers reached: invalidate expired sensor values and mark the
+//locations to refresh, so the computation never looks at time itself
+static void s_expire (AmbientLocation* self, time_t now) {
+  self->expired.clear();
+  self->expiry.advance(now, self->expired);
+  size_t size = self->snapshot ? self->snapshot->hierarchy.size() : 0;
+  for (auto &timer : self->expired) {
+    asset_id_t id = asset_id_t(timer.key >> 2);
+    int kind = int(timer.key & 3);
+    if(kind == AMBIENT_LOCATION_TIMER_REFRESH) {
+      ambient_location_node_t &node = self->locations[id];
+      if(timer.deadline != node.scheduled)
+        continue;
+      node.scheduled = 0;
+      if(node.refresh_at == AMBIENT_LOCATION_NEVER_EXPIRE)
+        continue;
+      if(node.refresh_at > now)
+        s_schedule(self, node.scheduled, node.refresh_at, timer.key);
+      else if(id < size)
+        s_mark_dirty(self, id);
+    }
+    else {
+      ambient_slot_t &slot = s_cache_slot(self->cache[id], kind);
+      if(timer.deadline != slot.scheduled)
+        continue;
+      slot.scheduled = 0;
+      if(!slot.valid)
+        continue;
+      if(slot.valid_till >= now) {
+        //received again since
+        s_schedule(self, slot.scheduled, slot.valid_till + 1, timer.key);
+      }
+      else {
+        slot.valid = false;
+        self->stats.add(AMBIENT_STAT_CACHE_EXPIRED);
+        if(id < size)
+          s_mark_dirty(self, self->snapshot->hierarchy.parent(id));
+      }
+    }
+  }
+}
+
+//compute every datacenter. Subtrees below the datacenters are independent,
+//the pool computes the ones needing it first, then the datacenters are
+//computed on top of them. Averages are queued in the serial order.
+static void s_compute_datacenters (AmbientLocation* self, AmbientWorkerPool& pool, time_t now) {
+  const AmbientHierarchy &hierarchy = self->snapshot->hierarchy;
+  self->tasks.clear();
+  if(pool.size() > 1) {
+    for (asset_id_t datacenter : hierarchy.datacenters()) {
+      //s_create_asset detaches datacenters, only a stored topology may still
+      //give one a parent: it is then in the subtree of another task, which
+      //its children must not be split from
+      if(hierarchy.parent(datacenter) != AmbientTopology::NONE)
+        continue;
+      const asset_id_t *end = hierarchy.children_end(datacenter);
+      for (const asset_id_t *child = hierarchy.children_begin(datacenter); child != end; child++) {
+        if(self->snapshot->assets[*child].sensor || !self->locations[*child].dirty)
+          continue;
+        self->tasks.push_back(*child);
+      }
+    }
+  }
+  if(self->tasks_computed.size() < self->tasks.size())
+    self->tasks_computed.resize(self->tasks.size());
+  pool.run(self->tasks.size(), [&](size_t task) {
+    s_compute_values(self, self->tasks_computed[task], self->tasks[task], now);
+  });
+
+  size_t task = 0;
+  for (asset_id_t datacenter : hierarchy.datacenters()) {
+    for (; task < self->tasks.size() && hierarchy.parent(self->tasks[task]) == datacenter; task++) {
+      ambient_compute_t &computed = self->tasks_computed[task];
+      self->computed.publications.insert(self->computed.publications.end(),
+        computed.publications.begin(), computed.publications.end());
+      self->computed.suppressed += computed.suppressed;
+      self->computed.recomputed.insert(self->computed.recomputed.end(),
+        computed.recomputed.begin(), computed.recomputed.end());
+      computed.publications.clear();
+      computed.suppressed = 0;
+      computed.recomputed.clear();
+    }
+    s_compute_values(self, self->computed, datacenter, now);
+  }
+
+  //the averages queued carry their ingest time, suppressed ones are not
+  //counted later either
+  for (asset_id_t id : self->computed.recomputed) {
+    ambient_location_node_t &node = self->locations[id];
+    node.ingested = 0;
+    if(node.refresh_at != AMBIENT_LOCATION_NEVER_EXPIRE)
+      s_schedule(self, node.scheduled, node.refresh_at, s_timer_key(id, AMBIENT_LOCATION_TIMER_REFRESH));
+  }
+  self->computed.recomputed.clear();
+}
+
+//collect what the stream actor received since last calculation, this is
+//the only time the calculation takes the lock. The topology is switched to
+//the latest published version, without any lock.
+static void s_collect_changes (AmbientLocation* self, std::vector<ambient_sensor_update_t>& updates, std::vector<asset_id_t>& changes) {
+  {
+    std::unique_lock<std::mutex> lock = s_lock_updates(self);
+    updates.swap(self->updates);
+  }
+  std::shared_ptr<const ambient_topology_version_t> version = std::atomic_load(&self->topology_published);
+  if(version && version != self->snapshot) {
+    self->snapshot = version;
+    self->topology_consumed.store(version->version);
+    changes = version->changes;
+  }
+}
+
+//remember on id and its ancestors the oldest sensor value they wait to publish
+static void s_mark_ingested (AmbientLocation* self, asset_id_t id, int64_t ingested) {
+  size_t steps = self->snapshot->hierarchy.size();
+  for (asset_id_t current = id; current != AmbientTopology::NONE && steps-- > 0; current = self->snapshot->hierarchy.parent(current)) {
+    ambient_location_node_t &node = self->locations[current];
+    if(node.ingested == 0 || ingested < node.ingested)
+      node.ingested = ingested;
+  }
+}
+
+//apply the changes to the calculation side and mark what must be recomputed
+static void s_apply_changes (AmbientLocation* self, std::vector<ambient_sensor_update_t>& updates, std::vector<asset_id_t>& changes) {
+  size_t size = self->snapshot ? self->snapshot->hierarchy.size() : 0;
+  if(size > self->locations.size()) {
+    self->locations.resize(size);
+    self->cache.resize(size);
+  }
+  for (auto &update : updates) {
+    //the sensor may be newer than the topology version we have, its
+    //parent will be marked when a version carrying it is loaded
+    if(update.id >= self->cache.size()) {
+      self->locations.resize(update.id + 1);
+      self->cache.resize(update.id + 1);
+    }
+    ambient_slot_t &slot = s_cache_slot(self->cache[update.id], update.type);
+    time_t scheduled = slot.scheduled;
+    slot = update.slot;
+    slot.scheduled = scheduled;
+    //expired once now > valid_till
+    if(slot.valid)
+      s_schedule(self, slot.scheduled, slot.valid_till + 1, s_timer_key(update.id, update.type));
+    if(update.id < size) {
+      s_mark_dirty(self, self->snapshot->hierarchy.parent(update.id));
+      //values restored at startup were not ingested
+      if(slot.valid && update.ingested)
+        s_mark_ingested(self, self->snapshot->hierarchy.parent(update.id), update.ingested);
+    }
+  }
+  for (asset_id_t id : changes) {
+    s_mark_dirty(self, id);
+  }
+  updates.clear();
+  changes.clear();
+}
+
+//write the statistics in shm, as metrics of the agent itself
+static void s_publish_stats (AmbientLocation* self) {
+  int ttl = self->clock->polling_interval() * 2;
+  zmsg_t *stats = zmsg_new();
+  s_append_stats(self, stats);
+  while (zmsg_size(stats) >= 2) {
+    char *name = zmsg_popstr(stats);
+    char *value = zmsg_popstr(stats);
+    std::string type = std::string("ambient.") + name;
+    int rv = fty_shm_write_metric(AMBIENT_LOCATION_STATS_ASSET, type.c_str(), value, "", ttl);
+    zstr_free(&name);
+    zstr_free(&value);
+    if (rv != 0) {
+      log_warning("SHM publish of %s@%s failed", type.c_str(), AMBIENT_LOCATION_STATS_ASSET);
+      break;
+    }
+  }
+  zmsg_destroy(&stats);
+}
+
+//save the sensor values which did not expire, by name since the ids of
+//the next run may differ; left alone in simulation, like the topology file
+static void s_save_values (AmbientLocation* self, time_t now) {
+  self->values_saved = now;
+  if(self->values_path.empty() || self->simulation || !self->snapshot)
+    return;
+  std::vector<ambient_stored_value_t> values;
+  size_t size = std::min(self->cache.size(), self->snapshot->hierarchy.size());
+  for (asset_id_t id = 0; id < size; id++) {
+    if(!self->snapshot->assets[id].sensor)
+      continue;
+    for (int type : { AMBIENT_LOCATION_TYPE_HUMIDITY, AMBIENT_LOCATION_TYPE_TEMP }) {
+      const ambient_slot_t &slot = s_cache_slot(self->cache[id], type);
+      if(!slot.valid || slot.valid_till < now)
+        continue;
+      ambient_stored_value_t value;
+      value.name = self->snapshot->hierarchy.name(id);
+      value.type = type;
+      value.value = slot.value;
+      value.valid_till = slot.valid_till;
+      value.ttl = slot.ttl;
+      values.push_back(value);
+    }
+  }
+  if(AmbientStore::save_values(self->values_path.c_str(), values) == 0)
+    log_debug("%zu sensor values saved in %s", values.size(), self->values_path.c_str());
+}
+
+//event-driven mode: when the updates pending since first are calculated
+static int64_t s_event_deadline (AmbientLocation* self, int64_t first) {
+  return std::min(self->updates_last.load(std::memory_order_relaxed) + self->debounce_ms,
+    first + self->max_latency_ms);
+}
+
+//run one calculation at now, return what it published
+static ambient_publish_stats_t s_calculate (AmbientLocation* self, AmbientWorkerPool& pool, time_t now,
+                                            std::vector<ambient_sensor_update_t>& updates, std::vector<asset_id_t>& changes) {
+  log_info("Starting calculation");
+  int64_t start = zclock_usecs();
+  ambient_publish_stats_t before = self->publish_stats;
+  //we want to be consistant for each datacenters
+  s_collect_changes(self, updates, changes);
+  s_apply_changes(self, updates, changes);
+  s_expire(self, now);
+  if (self->snapshot)
+    s_compute_datacenters(self, pool, now);
+  size_t queued = self->computed.publications.size();
+  self->publish_stats.suppressed += self->computed.suppressed;
+  self->computed.suppressed = 0;
+  s_flush_values(self);
+  log_info("End of calculation (%zu averages published, %" PRIu64 " unchanged, %zu subtrees in parallel)",
+    queued, self->publish_stats.suppressed - before.suppressed, self->tasks.size());
+
+  ambient_publish_stats_t cycle;
+  cycle.written = self->publish_stats.written - before.written;
+  cycle.suppressed = self->publish_stats.suppressed - before.suppressed;
+  cycle.failed = self->publish_stats.failed - before.failed;
+  uint64_t duration = zclock_usecs() - start;
+  self->stats.add(AMBIENT_STAT_SHM_SUPPRESSED, cycle.suppressed);
+  self->stats.add(AMBIENT_STAT_CYCLES);
+  self->stats.set(AMBIENT_STAT_CYCLE_US, duration);
+  self->stats.raise(AMBIENT_STAT_CYCLE_MAX_US, duration);
+  self->stats.add(AMBIENT_STAT_CYCLE_TOTAL_US, duration);
+  if (self->stats_publish)
+    s_publish_stats(self);
+  return cycle;
+}
+
 void
 ambient_location_calculation (zsock_t *pipe, void *args)
 {
@@ -564,27 +1369,35 @@ ambient_location_calculation (zsock_t *pipe, void *args)
   zpoller_t *poller = zpoller_new (pipe, NULL);
   assert(poller);
   zsock_signal (pipe, 0);
-  log_info ("calculation_actor: Started");
+  AmbientWorkerPool pool (self->threads);
+  self->expiry = AmbientTimingWheel (self->clock->now ());
+  self->values_saved = self->clock->now ();
+  log_info ("calculation_actor: Started (%zu threads%s)", pool.size (), self->simulation ? ", simulation" : "");
+  std::vector<ambient_sensor_update_t> updates;
+  std::vector<asset_id_t> changes;
+  //periodic calculation, expiring values and refreshing averages
+  int64_t next_cycle = self->clock->mono () + self->clock->polling_interval () * 1000;
+  //first UPDATE not calculated yet (event-driven mode), 0 if none
+  int64_t pending_since = 0;
   while (!zsys_interrupted)
   {
-    self->timeout_ms = fty_get_polling_interval() * 1000;
-    void *which = zpoller_wait (poller, self->timeout_ms);
+    //in simulation, calculations only run on TICK
+    int timeout = -1;
+    if (!self->simulation) {
+      int64_t now = self->clock->mono ();
+      int64_t deadline = pending_since ? std::min (next_cycle, s_event_deadline (self, pending_since)) : next_cycle;
+      timeout = deadline > now ? int (deadline - now) : 0;
+    }
+    void *which = zpoller_wait (poller, timeout);
+    bool tick = false;
     if (which == NULL) {
       if (zpoller_terminated(poller) || zsys_interrupted) {
         log_info ("calculation_actor: Terminating.");
         break;
-      } else {
-
-        log_info("Starting calculation");
-        //timeout, so we must calculate
-        //we want to be consistant for each datacenters
-        mtx_ambient_hashmap.lock();
-        for (auto &datacenter : self->datacenters) {
-          s_compute_values(self, datacenter);
-        }
-        mtx_ambient_hashmap.unlock();
-        log_info("End of calculation");
       }
+      //timeout, calculate unless more updates pushed the deadline back
+      int64_t now = self->clock->mono ();
+      tick = now >= next_cycle || (pending_since && now >= s_event_deadline (self, pending_since));
     }
     else if (which == pipe) {
       zmsg_t *msg = zmsg_recv(pipe);
@@ -595,6 +1408,7 @@ ambient_location_calculation (zsock_t *pipe, void *args)
       if (!command) {
         zmsg_destroy (&msg);
         log_warning ("Empty command in calculation.");
+        continue;
       }
       log_debug("Command : %s",command);
       if (streq(command, "$TERM")) {
@@ -602,18 +1416,267 @@ ambient_location_calculation (zsock_t *pipe, void *args)
         zmsg_destroy (&msg);
         zstr_free (&command);
         break;
+      } else if (streq(command, "TICK")) {
+        tick = true;
+      } else if (streq(command, "UPDATE")) {
+        if (!pending_since)
+          pending_since = self->clock->mono ();
       } else {
         log_debug ("calculation actor : Unknow command");
-        zmsg_destroy (&msg);
-        zstr_free (&command);
       }
+      zmsg_destroy (&msg);
+      zstr_free (&command);
+    }
+    if (tick) {
+      int64_t now = self->clock->mono ();
+      if (now >= next_cycle)
+        next_cycle = now + self->clock->polling_interval () * 1000;
+      else if (pending_since)
+        self->stats.add (AMBIENT_STAT_EVENT_CYCLES);
+      pending_since = 0;
+      ambient_publish_stats_t cycle = s_calculate(self, pool, self->clock->now(), updates, changes);
+      //each TICK is answered, other calculations reported on MONITOR
+      if (self->simulation || self->monitor) {
+        //CYCLE/duration (us)/averages written/averages unchanged
+        zstr_sendx (pipe, "CYCLE", std::to_string (self->stats.get (AMBIENT_STAT_CYCLE_US)).c_str (),
+          std::to_string (cycle.written).c_str (),
+          std::to_string (cycle.suppressed).c_str (), NULL);
+      }
+      if (self->clock->now () - self->values_saved >= self->values_interval)
+        s_save_values (self, self->clock->now ());
     }
   }
+  s_save_values (self, self->clock->now ());
   zpoller_destroy (&poller);
   log_info ("calculation_actor: Ended");
 }
 
 
+//mailbox requests: STATS is answered by OK/name/value/...
+static void
+s_ambloc_actor_mailbox (AmbientLocation* self, mlm_client_t *client, zmsg_t **message_p)
+{
+  zmsg_t *reply = zmsg_new ();
+  zmsg_addstr (reply, "OK");
+  s_append_stats (self, reply);
+  int rv = mlm_client_sendto (client, mlm_client_sender (client), mlm_client_subject (client), NULL, 1000, &reply);
+  if (rv != 0)
+    log_error ("Cannot answer %s request of %s", mlm_client_subject (client), mlm_client_sender (client));
+  zmsg_destroy (message_p);
+}
+
+//the asset burst is over: build its topology in one pass, then calculate
+static void
+s_end_bulk_load (AmbientLocation* self)
+{
+  self->bulk_loading = false;
+  //the saved assets the answer did not mention were removed meanwhile, unless
+  //there was no answer at all
+  if (!self->topology_confirmed.empty () && self->stats.get (AMBIENT_STAT_STARTUP_ASSETS) > 0) {
+    size_t removed = 0;
+    for (asset_id_t id = 0; id < self->topology_confirmed.size (); id++) {
+      if (!self->topology_confirmed[id] && s_remove_asset (self, id) == 0)
+        removed++;
+    }
+    log_info ("Saved topology reconciled (%zu assets removed)", removed);
+  }
+  self->topology_confirmed.clear ();
+  if (self->topology_changed)
+    s_publish_topology (self);
+  int64_t duration = self->clock->mono () - self->bulk_load_started;
+  self->stats.set (AMBIENT_STAT_STARTUP_MS, duration);
+  log_info ("Startup load done (%" PRIu64 " asset messages in %" PRId64 " ms, %zu assets)",
+    self->stats.get (AMBIENT_STAT_STARTUP_ASSETS), duration, self->topology.size ());
+  if (!self->ambient_calculation)
+    s_start_calculation (self);
+}
+
+//restore the sensor values saved by a previous run which did not expire
+//meanwhile, ahead of those received since START which are newer. Not in
+//simulation, where the values come from the recording only.
+static void
+s_load_values (AmbientLocation* self)
+{
+  std::vector<ambient_stored_value_t> values;
+  if (self->values_path.empty () || self->simulation || AmbientStore::load_values (self->values_path.c_str (), values) != 0)
+    return;
+  time_t now = self->clock->now ();
+  std::vector<ambient_sensor_update_t> restored;
+  for (const auto &value : values) {
+    asset_id_t id = self->topology.find (value.name);
+    if (id == AmbientTopology::NONE || !self->assets[id].sensor || value.valid_till < now
+      || (value.type != AMBIENT_LOCATION_TYPE_HUMIDITY && value.type != AMBIENT_LOCATION_TYPE_TEMP))
+      continue;
+    ambient_sensor_update_t update = ambient_sensor_update_t ();
+    update.id = id;
+    update.type = int (value.type);
+    update.slot.value = value.value;
+    update.slot.valid_till = time_t (value.valid_till);
+    update.slot.ttl = value.ttl;
+    update.slot.valid = true;
+    restored.push_back (update);
+  }
+  {
+    std::unique_lock<std::mutex> lock = s_lock_updates (self);
+    self->updates.insert (self->updates.begin (), restored.begin (), restored.end ());
+  }
+  self->stats.set (AMBIENT_STAT_CACHE_RESTORED, restored.size ());
+  log_info ("%zu of %zu saved sensor values restored from %s", restored.size (), values.size (),
+    self->values_path.c_str ());
+}
+
+static void
+s_start_calculation (AmbientLocation* self)
+{
+  s_load_values (self);
+  self->ambient_calculation = zactor_new (ambient_location_calculation, (void*) self);
+}
+
+//ms before the startup load is considered over
+static int
+s_bulk_load_timeout (AmbientLocation* self)
+{
+  int64_t now = self->clock->mono ();
+  int64_t deadline = std::min (self->bulk_load_last + BULK_LOAD_SETTLE_MS, self->bulk_load_started + BULK_LOAD_MAX_MS);
+  return deadline > now ? int (deadline - now) : 0;
+}
+
+//a message received by one of the clients
+static void
+s_ambloc_actor_client (AmbientLocation* self, mlm_client_t *client, zmsg_t **message_p)
+{
+    if (streq (mlm_client_command (client), "MAILBOX DELIVER")
+        && streq (mlm_client_subject (client), "STATS")) {
+        s_ambloc_actor_mailbox (self, client, message_p);
+        return;
+    }
+    if (!is_fty_proto(*message_p)) {
+        self->stats.add(AMBIENT_STAT_MESSAGES_IGNORED);
+        zmsg_destroy(message_p);
+        return;
+    }
+    if (self->recorder.is_open ()
+      && self->recorder.write (zclock_time (), mlm_client_address (client), *message_p) != 0) {
+      log_error ("Recording failed, stop recording");
+      self->recorder.close ();
+    }
+    if (self->bulk_loading && streq (mlm_client_address (client), FTY_PROTO_STREAM_ASSETS)) {
+      self->bulk_load_last = self->clock->mono ();
+      self->stats.add (AMBIENT_STAT_STARTUP_ASSETS);
+    }
+    s_ambloc_actor_stream(self, mlm_client_address (client), message_p);
+}
+
+//receive up to a batch of messages of a lane, the rest waits for the next
+//round
+static void
+s_serve_lane (AmbientLocation* self, ambient_lane_t& lane, bool& terminated)
+{
+    int received = 0;
+    while (received < lane.batch && (zsock_events (mlm_client_msgpipe (lane.client)) & ZMQ_POLLIN)) {
+        zmsg_t *msg = mlm_client_recv (lane.client);
+        if (!msg) {
+            terminated = true;
+            return;
+        }
+        received++;
+        s_ambloc_actor_client (self, lane.client, &msg);
+    }
+    self->stats.set (lane.backlog, received);
+    self->stats.raise (lane.backlog_max, received);
+    if (received == lane.batch && (zsock_events (mlm_client_msgpipe (lane.client)) & ZMQ_POLLIN))
+        self->stats.add (lane.yields);
+}
+
+//device name as a literal in a consumer pattern
+static std::string
+s_subject_escape (const std::string& device)
+{
+    std::string escaped;
+    for (char c : device) {
+        if (strchr ("\\^$.|?*+()[]{}", c))
+            escaped += '\\';
+        escaped += c;
+    }
+    return escaped;
+}
+
+//consume the sensor metrics of the devices of the known sensors, or of all
+//devices while one of the sensors has none. Patterns can only be added, the
+//metrics client is connected again to drop some, after it served the
+//messages it already received
+static void
+s_update_subscription (AmbientLocation* self, zpoller_t *poller)
+{
+    self->subscription_changed = false;
+    bool all = false;
+    std::vector<std::string> devices;
+    for (asset_id_t id = 0; id < self->assets.size (); id++) {
+        if (!self->assets[id].sensor || self->topology.parent (id) == AmbientTopology::NONE)
+            continue;
+        if (self->sensor_devices[id].empty ())
+            all = true;
+        else
+            devices.push_back (self->sensor_devices[id]);
+    }
+    std::sort (devices.begin (), devices.end ());
+    devices.erase (std::unique (devices.begin (), devices.end ()), devices.end ());
+    if (all)
+        devices.clear ();
+    if (all == self->subscribed_all && devices == self->subscribed_devices)
+        return;
+
+    if (self->subscribed_all || !mlm_client_connected (self->metrics_client)
+        || !std::includes (devices.begin (), devices.end (), self->subscribed_devices.begin (), self->subscribed_devices.end ())) {
+        mlm_client_t *previous = self->metrics_client;
+        while (zsock_events (mlm_client_msgpipe (previous)) & ZMQ_POLLIN) {
+            zmsg_t *msg = mlm_client_recv (previous);
+            if (!msg)
+                break;
+            s_ambloc_actor_client (self, previous, &msg);
+        }
+        s_flush_updates (self);
+        zpoller_remove (poller, mlm_client_msgpipe (previous));
+        mlm_client_destroy (&previous);
+        self->metrics_client = mlm_client_new ();
+        zpoller_add (poller, mlm_client_msgpipe (self->metrics_client));
+        self->subscribed_all = false;
+        self->subscribed_devices.clear ();
+        if (mlm_client_connect (self->metrics_client, self->endpoint.c_str (), 1000, self->metrics_name.c_str ()) == -1) {
+            log_error ("mlm_client_connect failed, sensor metrics not consumed until the next topology version");
+            return;
+        }
+        self->stats.add (AMBIENT_STAT_SUBSCRIPTION_RESETS);
+    }
+
+    std::vector<std::string> patterns;
+    if (all)
+        patterns.push_back (METRICS_SUBJECT_KINDS);
+    else {
+        std::vector<std::string> added;
+        std::set_difference (devices.begin (), devices.end (), self->subscribed_devices.begin (),
+            self->subscribed_devices.end (), std::back_inserter (added));
+        for (size_t i = 0; i < added.size (); i++) {
+            if (i % SUBSCRIPTION_DEVICES_MAX == 0)
+                patterns.push_back (METRICS_SUBJECT_KINDS "(");
+            else
+                patterns.back () += '|';
+            patterns.back () += s_subject_escape (added[i]);
+            if (i % SUBSCRIPTION_DEVICES_MAX == SUBSCRIPTION_DEVICES_MAX - 1 || i + 1 == added.size ())
+                patterns.back () += ")$";
+        }
+    }
+    for (const auto &pattern : patterns) {
+        if (mlm_client_set_consumer (self->metrics_client, FTY_PROTO_STREAM_METRICS_SENSOR, pattern.c_str ()) == -1)
+            log_error ("mlm_set_consumer failed");
+    }
+    self->subscribed_all = all;
+    self->subscribed_devices = devices;
+    self->stats.set (AMBIENT_STAT_SUBSCRIPTION_DEVICES, devices.size ());
+    log_info ("Sensor metrics consumed from %s (%zu patterns added)",
+        all ? "all devices" : (std::to_string (devices.size ()) + " devices").c_str (), patterns.size ());
+}
+
 // --------------------------------------------------------------------------
 // Create a new fty_ambient_location_server
 void
@@ -623,21 +1686,53 @@ fty_ambient_location_server (zsock_t *pipe, void *args)
     //AmbientLocation *self = fty_ambient_location_server_new ();
     assert (self);
 
-    zpoller_t *poller = zpoller_new (pipe, mlm_client_msgpipe (self->client), NULL);
+    zpoller_t *poller = zpoller_new (pipe, mlm_client_msgpipe (self->client), mlm_client_msgpipe (self->metrics_client), NULL);
     assert (poller);
+    ambient_lane_t lanes[] = {
+      { self->metrics_client, METRICS_BATCH_MAX, AMBIENT_STAT_LANE_METRICS_BACKLOG, AMBIENT_STAT_LANE_METRICS_BACKLOG_MAX,
+        AMBIENT_STAT_LANE_METRICS_YIELDS },
+      { self->client, ASSETS_BATCH_MAX, AMBIENT_STAT_LANE_ASSETS_BACKLOG, AMBIENT_STAT_LANE_ASSETS_BACKLOG_MAX,
+        AMBIENT_STAT_LANE_ASSETS_YIELDS }
+    };
 
     zsock_signal (pipe, 0);
+    bool calculation_polled = false;
     log_info ("ambient_actor: Started");
     //    poller timeout
     while (!zsys_interrupted)
     {
-        self->timeout_ms = fty_get_polling_interval() * 1000;
+        if (self->bulk_loading && !self->simulation && s_bulk_load_timeout (self) == 0)
+            s_end_bulk_load (self);
+        if (self->subscription_changed) {
+            s_update_subscription (self, poller);
+            lanes[0].client = self->metrics_client;
+        }
+        if (self->ingest_shm && zclock_mono () >= self->ingest_next) {
+            s_ingest_shm (self);
+            s_flush_updates (self);
+            self->ingest_next = zclock_mono () + self->ingest_interval_ms;
+        }
+        if (self->ambient_calculation && !calculation_polled) {
+            zpoller_add (poller, self->ambient_calculation);
+            calculation_polled = true;
+        }
+        //the startup load ends on TICK in simulation
+        if (self->bulk_loading)
+            self->timeout_ms = self->simulation ? -1 : s_bulk_load_timeout (self);
+        else
+            self->timeout_ms = self->topology_changed ? TOPOLOGY_SETTLE_MS : self->clock->polling_interval() * 1000;
+        if (self->ingest_shm) {
+            int ingest_ms = int (std::max<int64_t> (0, self->ingest_next - zclock_mono ()));
+            self->timeout_ms = self->timeout_ms < 0 ? ingest_ms : std::min (self->timeout_ms, ingest_ms);
+        }
         void *which = zpoller_wait (poller, self->timeout_ms);
         if (which == NULL) {
             if (zpoller_terminated(poller) || zsys_interrupted) {
                 log_info ("ambient_actor: Terminating.");
                 break;
             }
+            if (self->topology_changed && !self->bulk_loading)
+                s_publish_topology (self);
         }
         else if (which == pipe) {
             log_trace ("which == pipe");
@@ -645,27 +1740,41 @@ fty_ambient_location_server (zsock_t *pipe, void *args)
             if (!msg)
                 break;
 
-            int rv = s_ambloc_actor_commands (self, &msg);
+            int rv = s_ambloc_actor_commands (self, pipe, &msg);
             if (rv == 1)
                 break;
             continue;
         }
-        else if (which == mlm_client_msgpipe (self->client)) {
-
-            zmsg_t *msg = mlm_client_recv (self->client);
-            if (!msg)
-                break;
-
-            if (!is_fty_proto(msg)) {
-                zmsg_destroy(&msg);
-                continue;
-            } else {
-              s_ambloc_actor_stream(self, &msg);
+        else if (self->ambient_calculation && which == self->ambient_calculation) {
+            //calculation reports (MONITOR)
+            zmsg_t *msg = zmsg_recv (which);
+            if (msg)
+                zmsg_send (&msg, pipe);
+            continue;
+        }
+        else if (which == mlm_client_msgpipe (self->client) || which == mlm_client_msgpipe (self->metrics_client)) {
+            //one batch of each lane with messages pending, whichever woke
+            //us up; the sensor values of the round are coalesced then
+            //queued for the calculation at once
+            self->stats.add (AMBIENT_STAT_STREAM_WAKEUPS);
+            bool terminated = false;
+            for (auto &lane : lanes) {
+                if (!terminated)
+                    s_serve_lane (self, lane, terminated);
             }
+            s_flush_updates (self);
+            if (terminated)
+                break;
+            if (self->topology_changed && !self->bulk_loading
+                && self->clock->mono () - self->topology_changed_since >= TOPOLOGY_MAX_DELAY_MS)
+                s_publish_topology (self);
         }
 
     }
     zpoller_destroy (&poller);
+    //changes not published yet, an interrupted startup load is not saved
+    if (self->topology_changed && !self->bulk_loading)
+        s_save_topology (self);
     delete self;
     //fty_ambient_location_server_destroy(&self);
     log_info ("ambient_actor: Ended");
@@ -678,15 +1787,509 @@ AmbientLocation::~AmbientLocation()
 {
   zactor_destroy(&this->ambient_calculation);
   mlm_client_destroy(&this->client);
-  for( auto &sensor : this->cache) {
-    s_remove_from_cache(this, sensor.first, AMBIENT_LOCATION_TYPE_BOTH);
-  }
+  mlm_client_destroy(&this->metrics_client);
   log_info("ambient destroyed");
 }
 
+//  --------------------------------------------------------------------------
+//  Micro benchmarks of the internals (fty-metric-ambient-location-bench --micro)
+
+//  Build datacenters x rooms x rows x racks with an input and an output
+//  sensor in each rack, and give all sensors a value
+static void
+s_build_sites (AmbientLocation *self, AmbientTopology &topology, int datacenters, int rooms, int rows, int racks)
+{
+    auto version = std::make_shared<ambient_topology_version_t> ();
+    version->version = 1;
+    auto add = [&] (const std::string &name, asset_id_t parent, ambient_location_kind_t kind) {
+        asset_id_t id = topology.intern (name);
+        version->assets.resize (topology.size ());
+        version->assets[id].kind = kind;
+        if (parent != AmbientTopology::NONE)
+            topology.attach (id, parent);
+        return id;
+    };
+    int n = 0;
+    for (int d = 0; d < datacenters; d++) {
+        std::string dc_name = "datacenter-" + std::to_string (d);
+        asset_id_t dc = add (dc_name, AmbientTopology::NONE, AMBIENT_LOCATION_KIND_OTHER);
+        topology.add_datacenter (dc);
+        for (int m = 0; m < rooms; m++) {
+            std::string room_name = dc_name + "-room-" + std::to_string (m);
+            asset_id_t room = add (room_name, dc, AMBIENT_LOCATION_KIND_OTHER);
+            for (int w = 0; w < rows; w++) {
+                std::string row_name = room_name + "-row-" + std::to_string (w);
+                asset_id_t row = add (row_name, room, AMBIENT_LOCATION_KIND_ROW);
+                for (int k = 0; k < racks; k++) {
+                    std::string rack_name = row_name + "-rack-" + std::to_string (k);
+                    asset_id_t rack = add (rack_name, row, AMBIENT_LOCATION_KIND_RACK);
+                    for (ambient_function_t function : {AMBIENT_FUNCTION_INPUT, AMBIENT_FUNCTION_OUTPUT}) {
+                        asset_id_t sensor = add ("sensor-" + std::to_string (n), rack, AMBIENT_LOCATION_KIND_OTHER);
+                        version->assets[sensor].sensor = true;
+                        version->assets[sensor].function = function;
+                        self->cache.resize (topology.size ());
+                        ambient_slot_t slot = { 15 + (n * 7) % 23 + n / 3.0, AMBIENT_LOCATION_NEVER_EXPIRE, 300, true, 0 };
+                        self->cache[sensor].temperature = slot;
+                        slot.value = 30 + (n * 11) % 41;
+                        self->cache[sensor].humidity = slot;
+                        n++;
+                    }
+                }
+            }
+        }
+    }
+    topology.compile (version->hierarchy);
+    self->snapshot = version;
+    self->locations.resize (topology.size ());
+}
+
+static zmsg_t *
+s_encode_asset (const std::string &name, const char *type, const char *subtype, const std::string &parent, const char *function)
+{
+  zhash_t *aux = zhash_new ();
+  zhash_autofree (aux);
+  zhash_insert (aux, "status", (void *) "active");
+  zhash_insert (aux, "type", (void *) type);
+  zhash_insert (aux, "subtype", (void *) subtype);
+  zhash_t *ext = NULL;
+  if (function) {
+    ext = zhash_new ();
+    zhash_autofree (ext);
+    zhash_insert (ext, "logical_asset", (void *) parent.c_str ());
+    zhash_insert (ext, "sensor_function", (void *) function);
+  }
+  else if (!parent.empty ())
+    zhash_insert (aux, "parent_name.1", (void *) parent.c_str ());
+  zmsg_t *msg = fty_proto_encode_asset (aux, name.c_str (), FTY_PROTO_ASSET_OP_CREATE, ext);
+  zhash_destroy (&aux);
+  zhash_destroy (&ext);
+  return msg;
+}
+
+//  Feed the stream side with one datacenter of rooms x racks, two sensors
+//  per rack, return the sensor names
+static std::vector<std::string>
+s_stream_site (AmbientLocation *self, int rooms, int racks)
+{
+  std::vector<std::string> sensors;
+  std::vector<zmsg_t *> messages;
+  messages.push_back (s_encode_asset ("datacenter-0", "datacenter", "N_A", "", NULL));
+  for (int m = 0; m < rooms; m++) {
+    std::string room = "room-" + std::to_string (m);
+    messages.push_back (s_encode_asset (room, "room", "N_A", "datacenter-0", NULL));
+    for (int k = 0; k < racks; k++) {
+      std::string rack = room + "-rack-" + std::to_string (k);
+      messages.push_back (s_encode_asset (rack, "rack", "N_A", room, NULL));
+      for (const char *function : {"input", "output"}) {
+        sensors.push_back ("sensor-" + std::to_string (sensors.size ()));
+        messages.push_back (s_encode_asset (sensors.back (), "device", "sensor", rack, function));
+      }
+    }
+  }
+  for (zmsg_t *msg : messages)
+    s_ambloc_actor_stream (self, FTY_PROTO_STREAM_ASSETS, &msg);
+  return sensors;
+}
+
+//  Run operations by batches until 200 ms were spent in them. prepare (batch)
+//  is called before each batch, out of the measure.
+template <typename Prepare, typename Run>
+static ambient_microbench_t
+s_microbench (const char *name, const std::atomic<uint64_t> *allocations, Prepare prepare, Run run)
+{
+  ambient_microbench_t result;
+  result.name = name;
+  result.operations = 0;
+  uint64_t allocated = 0;
+  std::chrono::nanoseconds elapsed (0);
+  for (size_t batch = 1; elapsed < std::chrono::milliseconds (200); batch = std::min<size_t> (batch * 2, 4096)) {
+    prepare (batch);
+    uint64_t before = allocations ? allocations->load () : 0;
+    auto start = std::chrono::steady_clock::now ();
+    for (size_t i = 0; i < batch; i++)
+      run (i);
+    elapsed += std::chrono::steady_clock::now () - start;
+    if (allocations)
+      allocated += allocations->load () - before;
+    result.operations += batch;
+  }
+  result.ns_per_op = double (elapsed.count ()) / result.operations;
+  result.allocations_per_op = double (allocated) / result.operations;
+  return result;
+}
+
+std::vector<ambient_microbench_t>
+fty_ambient_location_server_microbench (const std::atomic<uint64_t> *allocations)
+{
+  std::vector<ambient_microbench_t> results;
+  time_t now = ::time (NULL);
+  auto nothing = [] (size_t) {};
+
+  //  calculation over a prebuilt site of 677 locations and 1280 sensors
+  {
+    AmbientTopology topology;
+    AmbientLocation self;
+    s_build_sites (&self, topology, 1, 4, 8, 20);
+    self.expiry = AmbientTimingWheel (now);
+    AmbientWorkerPool pool (1);
+    s_compute_datacenters (&self, pool, now);
+    self.computed.publications.clear ();
+
+    results.push_back (s_microbench ("compute_values.full", allocations, nothing, [&] (size_t) {
+      for (auto &node : self.locations)
+        node.dirty = true;
+      s_compute_datacenters (&self, pool, now);
+      self.computed.publications.clear ();
+    }));
+
+    asset_id_t sensor = topology.find ("sensor-0");
+    results.push_back (s_microbench ("compute_values.one_sensor", allocations, nothing, [&] (size_t i) {
+      self.cache[sensor].temperature.value = 20 + i % 2;
+      s_mark_dirty (&self, topology.parent (sensor));
+      s_compute_datacenters (&self, pool, now);
+      self.computed.publications.clear ();
+    }));
+  }
+
+  //  stream side: decode, lookup and queue sensor metrics (including their
+  //  republication in shm), then asset moves and removals
+  {
+    AmbientLocation self;
+    std::vector<std::string> sensors = s_stream_site (&self, 8, 40);
+    std::vector<zmsg_t *> messages;
+    auto encode = [&] (size_t batch) {
+      self.updates.clear ();
+      messages.resize (batch);
+      for (size_t i = 0; i < batch; i++) {
+        zhash_t *aux = zhash_new ();
+        zhash_autofree (aux);
+        const std::string &sensor = sensors[i % sensors.size ()];
+        zhash_insert (aux, "sname", (void *) sensor.c_str ());
+        messages[i] = fty_proto_encode_metric (aux, now, 300, i % 2 ? "humidity.0" : "temperature.0",
+          sensor.c_str (), std::to_string (20 + i % 10).c_str (), i % 2 ? "%" : "C");
+        zhash_destroy (&aux);
+      }
+    };
+    results.push_back (s_microbench ("stream.metric", allocations, encode, [&] (size_t i) {
+      s_ambloc_actor_stream (&self, FTY_PROTO_STREAM_METRICS_SENSOR, &messages[i]);
+      s_flush_updates (&self);
+    }));
+
+    //  decoding alone, in place and by fty_proto
+    results.push_back (s_microbench ("decode.metric", allocations, encode, [&] (size_t i) {
+      self.metric.decode (messages[i]);
+      zmsg_destroy (&messages[i]);
+    }));
+    results.push_back (s_microbench ("decode.metric.fty_proto", allocations, encode, [&] (size_t i) {
+      fty_proto_t *bmsg = fty_proto_decode (&messages[i]);
+      fty_proto_destroy (&bmsg);
+    }));
+
+    //  move sensors to another rack and back, then remove and create them
+    std::vector<fty_proto_t *> moves;
+    for (size_t i = 0; i < 64; i++) {
+      std::string rack = "room-" + std::to_string (i % 8) + "-rack-" + std::to_string ((i + 1) % 40);
+      zmsg_t *msg = s_encode_asset (sensors[i], "device", "sensor", rack, i % 2 ? "output" : "input");
+      moves.push_back (fty_proto_decode (&msg));
+      msg = s_encode_asset (sensors[i], "device", "sensor", "room-" + std::to_string (i % 8) + "-rack-0", "input");
+      moves.push_back (fty_proto_decode (&msg));
+    }
+    results.push_back (s_microbench ("asset.create_remove", allocations, [&] (size_t) {
+      self.changes.clear ();
+    }, [&] (size_t i) {
+      fty_proto_t *asset = moves[i % moves.size ()];
+      s_create_asset (&self, asset);
+      s_remove_asset (&self, asset);
+      s_create_asset (&self, asset);
+    }));
+    for (fty_proto_t *asset : moves)
+      fty_proto_destroy (&asset);
+  }
+
+  //  the same sensor metrics read in shm instead (ingest/backend shm): one
+  //  read of all of them, the first time ingested, then found unchanged
+  {
+    AmbientLocation self;
+    self.ingest_shm = true;
+    std::vector<std::string> sensors = s_stream_site (&self, 8, 40);
+    for (size_t i = 0; i < sensors.size () * 2; i++)
+      fty::shm::write_metric (sensors[i / 2], i % 2 ? "humidity.0" : "temperature.0",
+        std::to_string (20 + i % 10), i % 2 ? "%" : "C", 300);
+    results.push_back (s_microbench ("ingest.shm.read", allocations, [&] (size_t) {
+      self.updates.clear ();
+    }, [&] (size_t) {
+      s_ingest_shm (&self);
+      s_flush_updates (&self);
+    }));
+  }
+
+  //  shm writes, in the test directory set by the caller
+  {
+    std::vector<std::string> names;
+    for (int i = 0; i < 1000; i++)
+      names.push_back ("rack-" + std::to_string (i));
+    results.push_back (s_microbench ("publish_value", allocations, nothing, [&] (size_t i) {
+      s_publish_value ("average.temperature", "C", names[i % names.size ()].c_str (), 20 + i % 10, 300, now);
+    }));
+  }
+  return results;
+}
+
 //  --------------------------------------------------------------------------
 //  Self test of this class
 
+//  Calculation side only, without broker
+static void
+s_test_calculation ()
+{
+    //  parallel computation publishes exactly what the serial one does
+    {
+        AmbientTopology serial_topology, parallel_topology;
+        AmbientLocation serial, parallel;
+        s_build_sites (&serial, serial_topology, 3, 4, 2, 5);
+        s_build_sites (&parallel, parallel_topology, 3, 4, 2, 5);
+        AmbientWorkerPool serial_pool (1);
+        AmbientWorkerPool parallel_pool (4);
+        time_t now = ::time (NULL);
+        s_compute_datacenters (&serial, serial_pool, now);
+        s_compute_datacenters (&parallel, parallel_pool, now);
+        assert (serial.tasks.empty ());
+        assert (parallel.tasks.size () == 12);
+        assert (!serial.computed.publications.empty ());
+        assert (serial.computed.publications.size () == parallel.computed.publications.size ());
+        for (size_t i = 0; i < serial.computed.publications.size (); i++) {
+            const ambient_publication_t &a = serial.computed.publications[i];
+            const ambient_publication_t &b = parallel.computed.publications[i];
+            assert (a.id == b.id && a.output == b.output && a.ttl == b.ttl);
+            assert (memcmp (&a.value, &b.value, sizeof (double)) == 0);
+        }
+        //  nothing changed, nothing to compute again
+        parallel.computed.publications.clear ();
+        s_compute_datacenters (&parallel, parallel_pool, now);
+        assert (parallel.tasks.empty ());
+        assert (parallel.computed.publications.empty ());
+    }
+
+    //  sensor values expire through the timing wheel
+    {
+        AmbientTopology topology;
+        AmbientLocation self;
+        s_build_sites (&self, topology, 1, 1, 1, 1);
+        time_t now = ::time (NULL);
+        self.expiry = AmbientTimingWheel (now);
+        AmbientWorkerPool pool (1);
+        s_compute_datacenters (&self, pool, now);
+        assert (self.computed.publications.size () == 14);
+        self.computed.publications.clear ();
+
+        asset_id_t sensor = topology.find ("sensor-0");
+        asset_id_t rack = topology.parent (sensor);
+        std::vector<ambient_sensor_update_t> updates (1);
+        std::vector<asset_id_t> changes;
+        updates[0].id = sensor;
+        updates[0].type = AMBIENT_LOCATION_TYPE_TEMP;
+        updates[0].slot = { 20, now + 10, 10, true, 0 };
+        s_apply_changes (&self, updates, changes);
+        assert (self.locations[rack].dirty);
+        s_compute_datacenters (&self, pool, now);
+        assert (!self.locations[rack].dirty);
+
+        //  still valid at valid_till, expired right after
+        s_expire (&self, now + 10);
+        assert (self.cache[sensor].temperature.valid);
+        s_expire (&self, now + 11);
+        assert (!self.cache[sensor].temperature.valid);
+        assert (self.locations[rack].dirty);
+        assert (self.locations[topology.datacenters ()[0]].dirty);
+        assert (self.cache[sensor].humidity.valid);
+    }
+
+    //  a day of virtual time, one calculation a minute: same output with one
+    //  or several threads, sensor-3 silent between 6:00 and 8:00 expires
+    {
+        std::vector<ambient_publish_stats_t> cycles[2];
+        std::vector<ambient_location_node_t> locations[2];
+        for (int run = 0; run < 2; run++) {
+            AmbientTopology topology;
+            AmbientLocation self;
+            AmbientVirtualClock *clock = new AmbientVirtualClock (1600000000, 60);
+            self.clock.reset (clock);
+            self.simulation = clock;
+            s_build_sites (&self, topology, 1, 2, 1, 2);
+            self.expiry = AmbientTimingWheel (clock->now ());
+            AmbientWorkerPool pool (run == 0 ? 1 : 3);
+            std::vector<ambient_sensor_update_t> updates;
+            std::vector<asset_id_t> changes;
+            bool expired = false;
+            for (int minute = 0; minute < 24 * 60; minute++) {
+                time_t now = clock->advance (clock->polling_interval ());
+                for (int n = 0; n < 8; n++) {
+                    if ((minute % (n + 1)) != 0 || (n == 3 && minute >= 6 * 60 && minute < 8 * 60))
+                        continue;
+                    ambient_sensor_update_t update = ambient_sensor_update_t ();
+                    update.id = topology.find ("sensor-" + std::to_string (n));
+                    update.type = (minute / (n + 1)) % 2 ? AMBIENT_LOCATION_TYPE_HUMIDITY : AMBIENT_LOCATION_TYPE_TEMP;
+                    update.slot = { 20 + (minute * 7 + n) % 13 / 2.0, now + 300, 300, true, 0 };
+                    self.updates.push_back (update);
+                }
+                cycles[run].push_back (s_calculate (&self, pool, now, updates, changes));
+                if (minute == 7 * 60) {
+                    const ambient_sensor_t &silent = self.cache[topology.find ("sensor-3")];
+                    expired = !silent.temperature.valid && !silent.humidity.valid;
+                }
+            }
+            assert (expired);
+            assert (self.publish_stats.written > 0 && self.publish_stats.failed == 0);
+            locations[run] = self.locations;
+        }
+        assert (cycles[0].size () == cycles[1].size ());
+        for (size_t i = 0; i < cycles[0].size (); i++)
+            assert (cycles[0][i].written == cycles[1][i].written && cycles[0][i].suppressed == cycles[1][i].suppressed);
+        assert (locations[0].size () == locations[1].size ());
+        for (size_t i = 0; i < locations[0].size (); i++)
+            for (int output = 0; output < AMBIENT_OUTPUT_COUNT; output++) {
+                const ambient_published_t &a = locations[0][i].published[output];
+                const ambient_published_t &b = locations[1][i].published[output];
+                assert (a.time == b.time && memcmp (&a.value, &b.value, sizeof (double)) == 0);
+            }
+        fty_shm_delete_test_dir ();
+    }
+}
+
+//  The sensor values of a batch of messages are coalesced, the latest one
+//  of each sensor and type wins
+static void
+s_test_coalescing ()
+{
+    AmbientLocation self;
+    std::vector<std::string> sensors = s_stream_site (&self, 1, 1);
+    auto stream = [&] (const std::string &sensor, const char *type, const char *value) {
+        zhash_t *aux = zhash_new ();
+        zhash_autofree (aux);
+        zhash_insert (aux, "sname", (void *) sensor.c_str ());
+        zmsg_t *msg = fty_proto_encode_metric (aux, ::time (NULL), 300, type, sensor.c_str (), value, "C");
+        zhash_destroy (&aux);
+        s_ambloc_actor_stream (&self, FTY_PROTO_STREAM_METRICS_SENSOR, &msg);
+    };
+    stream (sensors[0], "temperature.0", "20");
+    stream (sensors[0], "humidity.0", "40");
+    stream (sensors[0], "temperature.1", "21");
+    stream (sensors[1], "temperature.0", "30");
+    stream (sensors[0], "temperature.0", "22");
+    assert (self.pending.size () == 3);
+    assert (self.stats.get (AMBIENT_STAT_METRICS_RECEIVED) == 5);
+    assert (self.stats.get (AMBIENT_STAT_METRICS_COALESCED) == 2);
+    assert (self.updates.empty ());
+
+    s_flush_updates (&self);
+    assert (self.pending.empty ());
+    assert (self.updates.size () == 3);
+    assert (self.updates[0].id == self.topology.find (sensors[0]));
+    assert (self.updates[0].type == AMBIENT_LOCATION_TYPE_TEMP);
+    assert (self.updates[0].slot.value == 22);
+    assert (self.updates[1].type == AMBIENT_LOCATION_TYPE_HUMIDITY);
+    assert (self.updates[2].slot.value == 30);
+    assert (self.stats.get (AMBIENT_STAT_SHM_WRITES) == 3);
+
+    //  the next batch starts over
+    stream (sensors[0], "temperature.0", "23");
+    s_flush_updates (&self);
+    assert (self.updates.size () == 4 && self.updates[3].slot.value == 23);
+    assert (self.stats.get (AMBIENT_STAT_METRICS_COALESCED) == 2);
+}
+
+//  An asset moved below one of its descendants is refused, the hierarchy
+//  never gets a cycle
+static void
+s_test_cycle ()
+{
+    AmbientLocation self;
+    s_stream_site (&self, 1, 1);
+    asset_id_t datacenter = self.topology.find ("datacenter-0");
+    asset_id_t room = self.topology.find ("room-0");
+    asset_id_t rack = self.topology.find ("room-0-rack-0");
+    zmsg_t *msg = s_encode_asset ("room-0", "room", "N_A", "room-0-rack-0", NULL);
+    s_ambloc_actor_stream (&self, FTY_PROTO_STREAM_ASSETS, &msg);
+    msg = s_encode_asset ("room-0", "room", "N_A", "room-0", NULL);
+    s_ambloc_actor_stream (&self, FTY_PROTO_STREAM_ASSETS, &msg);
+    assert (self.topology.parent (room) == datacenter);
+    assert (self.topology.parent (rack) == room);
+    assert (self.topology.is_datacenter (datacenter));
+}
+
+//  Value of a statistic in a STATS answer
+static uint64_t
+s_test_stat (zmsg_t *reply, const char *name)
+{
+    for (zframe_t *frame = zmsg_first (reply); frame; frame = zmsg_next (reply)) {
+        bool found = zframe_streq (frame, name);
+        frame = zmsg_next (reply);
+        assert (frame);
+        if (found) {
+            char *value = zframe_strdup (frame);
+            uint64_t result = strtoull (value, NULL, 10);
+            zstr_free (&value);
+            return result;
+        }
+    }
+    assert (false);
+    return 0;
+}
+
+//  Send msg to the agent as if it came from stream
+static void
+s_test_stream (zactor_t *agent, const char *stream, zmsg_t *msg)
+{
+    zmsg_pushstr (msg, stream);
+    zmsg_pushstr (msg, "STREAM");
+    zmsg_send (&msg, agent);
+}
+
+//  Humidity of sensor, as the sensor stream carries it
+static zmsg_t *
+s_test_metric (const char *sensor, const char *value)
+{
+    zhash_t *aux = zhash_new ();
+    zhash_autofree (aux);
+    zhash_insert (aux, "sname", (void *) sensor);
+    zmsg_t *msg = fty_proto_encode_metric (aux, ::time (NULL), 60, "humidity.0", "HM1", value, "%");
+    zhash_destroy (&aux);
+    return msg;
+}
+
+//  Wait until metric@asset is value in shm, return false on timeout
+static bool
+s_test_wait_value (const char *asset, const char *metric, const char *value, int timeout_ms)
+{
+    int64_t deadline = zclock_mono () + timeout_ms;
+    while (zclock_mono () < deadline) {
+        fty::shm::shmMetrics result;
+        fty::shm::read_metrics (asset, metric, result);
+        if (result.size () > 0 && streq (fty_proto_value (result.get (0)), value))
+            return true;
+        zclock_sleep (1);
+    }
+    return false;
+}
+
+//  Wait until the stream actor handled the humidity of sensor (it copies it
+//  in shared memory), then run one calculation of the simulation
+static void
+s_test_tick (zactor_t *ambient_location, const char *sensor, const char *value)
+{
+    for (int i = 0; sensor && i < 5000; i++) {
+        fty::shm::shmMetrics result;
+        fty::shm::read_metrics (sensor, "humidity.default", result);
+        if (result.size () > 0 && streq (fty_proto_value (result.get (0)), value))
+            break;
+        zclock_sleep (1);
+    }
+    zstr_send (ambient_location, "TICK");
+    char *report = zstr_recv (ambient_location);
+    assert (report && streq (report, "CYCLE"));
+    zstr_free (&report);
+}
+
 void
 fty_ambient_location_server_test (bool verbose)
 {
@@ -696,6 +2299,7 @@ fty_ambient_location_server_test (bool verbose)
     if (verbose)
         ftylog_setVeboseMode(ftylog_getInstance());
     //     @selftest
+
     static const char *endpoint =  "inproc://fty_metric_ambient_location_test";
 
     zactor_t *server = zactor_new (mlm_server, (void*) "Malamute");
@@ -709,16 +2313,37 @@ fty_ambient_location_server_test (bool verbose)
     const char *SELFTEST_DIR_RW = "src/selftest-rw";
     assert (SELFTEST_DIR_RO);
     assert (SELFTEST_DIR_RW);
-    fty_shm_set_test_dir(SELFTEST_DIR_RW);
+    //  fty-shm test dir, emptied between the parts of the test, unlike the
+    //  files they keep in SELFTEST_DIR_RW
+    std::string shm_dir = std::string (SELFTEST_DIR_RW) + "/shm";
+    fty_shm_set_test_dir(shm_dir.c_str ());
     fty_shm_set_default_polling_interval(2);
+
+    s_test_calculation ();
+    fty_shm_set_test_dir(shm_dir.c_str ());
+    s_test_coalescing ();
+    s_test_cycle ();
     // std::string str_SELFTEST_DIR_RO = std::string(SELFTEST_DIR_RO);
     // std::string str_SELFTEST_DIR_RW = std::string(SELFTEST_DIR_RW);
 
+    //  store/topology and store/values of the selftest configuration, left
+    //  by a previous run
+    std::string topology_path = std::string (SELFTEST_DIR_RW) + "/server-topology.bin";
+    std::string values_path = std::string (SELFTEST_DIR_RW) + "/server-values.bin";
+    unlink (topology_path.c_str ());
+    unlink (values_path.c_str ());
+
     zactor_t *ambient_location = zactor_new (fty_ambient_location_server, NULL);
 
+    std::string config_path = std::string (SELFTEST_DIR_RO) + "/fty-metric-ambient-location.cfg";
+    zstr_sendx (ambient_location, "CONFIG", config_path.c_str (), NULL);
     zstr_sendx (ambient_location, "CONNECT", endpoint, "fty-ambient-location", NULL);
     zstr_sendx (ambient_location, "CONSUMER", FTY_PROTO_STREAM_METRICS_SENSOR, ".*", NULL);
     zstr_sendx (ambient_location, "CONSUMER", FTY_PROTO_STREAM_ASSETS, ".*", NULL);
+    //  calculations driven by the test, every 5 s of virtual time
+    zstr_sendx (ambient_location, "SIMULATE", "0", "5", NULL);
+    std::string record_path = std::string (SELFTEST_DIR_RW) + "/server-recording.bin";
+    zstr_sendx (ambient_location, "RECORD", record_path.c_str (), NULL);
 
     sleep(1);
     mlm_client_t *producer_m = mlm_client_new ();
@@ -728,13 +2353,15 @@ fty_ambient_location_server_test (bool verbose)
     mlm_client_connect (producer, endpoint, 1000, "producer");
     mlm_client_set_producer (producer, FTY_PROTO_STREAM_ASSETS);
 
-    //Build hierarchy (two sensor -input- on a datacenter)
+    //Build hierarchy (two sensor -input- on a datacenter, plugged into HM1
+    //and HM2)
     zhash_t *aux = zhash_new ();
     zhash_autofree (aux);
 
     zhash_insert (aux, "status", (void *) "active");
     zhash_insert (aux, "type", (void *) "device");
     zhash_insert (aux, "subtype", (void *) "sensor");
+    zhash_insert (aux, "parent_name.1", (void *) "HM1");
 
     zhash_t *ext = zhash_new ();
     zhash_autofree (ext);
@@ -762,6 +2389,7 @@ fty_ambient_location_server_test (bool verbose)
     zhash_insert (aux, "status", (void *) "active");
     zhash_insert (aux, "type", (void *) "device");
     zhash_insert (aux, "subtype", (void *) "sensor");
+    zhash_insert (aux, "parent_name.1", (void *) "HM2");
 
     ext = zhash_new ();
     zhash_autofree (ext);
@@ -804,12 +2432,16 @@ fty_ambient_location_server_test (bool verbose)
     zstr_sendx (ambient_location, "START", NULL);
     sleep(1);
 
-    //publish metrics
+    //publish metrics, the broker keeps those of other devices
     aux = zhash_new ();
     zhash_autofree (aux);
 
     zhash_insert (aux, "sname", (void *) "sensor-1");
 
+    msg = fty_proto_encode_metric (aux, ::time (NULL), 60, "humidity.0", "HM9", "99", "%");
+    assert (msg);
+    mlm_client_send (producer_m, "humidity.0@HM9", &msg);
+
     msg = fty_proto_encode_metric (aux, ::time (NULL), 60, "humidity.0", "HM1", "40", "%");
     assert (msg);
     mlm_client_send (producer_m, "humidity.0@HM1", &msg);
@@ -817,7 +2449,7 @@ fty_ambient_location_server_test (bool verbose)
       zhash_destroy(&aux);
 
     //wait calculation
-    sleep(5);
+    s_test_tick (ambient_location, "sensor-1", "40.00");
 
     fty_proto_t *m;
     {
@@ -828,7 +2460,7 @@ fty_ambient_location_server_test (bool verbose)
       assert (m);
       assert (streq (fty_proto_value (m), "40.00"));    // <<< 40 / 1
       fty_shm_delete_test_dir();
-      fty_shm_set_test_dir(SELFTEST_DIR_RW);
+      fty_shm_set_test_dir(shm_dir.c_str ());
       m = NULL;
     }
 
@@ -844,7 +2476,7 @@ fty_ambient_location_server_test (bool verbose)
       zhash_destroy(&aux);
 
     //wait calculation
-    sleep(5);
+    s_test_tick (ambient_location, "sensor-2", "100.00");
 
     {
       fty::shm::shmMetrics resultT;
@@ -854,7 +2486,7 @@ fty_ambient_location_server_test (bool verbose)
       assert (m);
       assert (streq (fty_proto_value (m), "70.00"));    // <<< (100 + 40) / 2
       fty_shm_delete_test_dir();
-      fty_shm_set_test_dir(SELFTEST_DIR_RW);
+      fty_shm_set_test_dir(shm_dir.c_str ());
       m = NULL;
     }
 
@@ -871,7 +2503,7 @@ fty_ambient_location_server_test (bool verbose)
       zhash_destroy(&aux);
 
     //wait calculation
-    sleep(5);
+    s_test_tick (ambient_location, "sensor-1", "70.00");
 
     {
       fty::shm::shmMetrics resultT;
@@ -881,11 +2513,343 @@ fty_ambient_location_server_test (bool verbose)
       assert (m);
       assert (streq (fty_proto_value (m), "85.00"));    // <<< (70 + 100)  / 2
       fty_shm_delete_test_dir();
-      fty_shm_set_test_dir(SELFTEST_DIR_RW);
+      fty_shm_set_test_dir(shm_dir.c_str ());
+      m = NULL;
+    }
+
+    //nothing changed, next calculations must not republish
+    s_test_tick (ambient_location, NULL, NULL);
+
+    {
+      fty::shm::shmMetrics resultT;
+      fty::shm::read_metrics("datacenter-1", ".*humidity", resultT);
+      assert (resultT.size() == 0);
+    }
+
+    // move HM2 within the deadband (0.5)
+    aux = zhash_new ();
+    zhash_autofree (aux);
+
+    zhash_insert (aux, "sname", (void *) "sensor-2");
+
+    msg = fty_proto_encode_metric (aux, ::time (NULL), 60, "humidity.0", "HM2", "100.6", "%");
+    assert (msg);
+    mlm_client_send (producer_m, "humidity.0@HM2", &msg);
+    if (aux)
+      zhash_destroy(&aux);
+
+    //wait calculation
+    s_test_tick (ambient_location, "sensor-2", "100.60");
+
+    {
+      fty::shm::shmMetrics resultT;
+      fty::shm::read_metrics("datacenter-1", ".*humidity", resultT);
+      assert (resultT.size() == 0);    // <<< (70 + 100.6) / 2 = 85.3 not published
+    }
+
+    //statistics on the mailbox
+    {
+      msg = zmsg_new ();
+      rv = mlm_client_sendto (producer, "fty-ambient-location", "STATS", NULL, 1000, &msg);
+      assert (rv == 0);
+      msg = mlm_client_recv (producer);
+      assert (msg);
+      assert (streq (mlm_client_subject (producer), "STATS"));
+      char *status = zmsg_popstr (msg);
+      assert (status && streq (status, "OK"));
+      zstr_free (&status);
+      assert (s_test_stat (msg, "metrics.received") == 4);
+      assert (s_test_stat (msg, "cache.updates") == 4);
+      assert (s_test_stat (msg, "assets.received") == 3);
+      assert (s_test_stat (msg, "topology.sensors") == 2);
+      assert (s_test_stat (msg, "topology.datacenters") == 1);
+      assert (s_test_stat (msg, "cycles") == 5);
+      assert (s_test_stat (msg, "shm.writes") >= 4 + 3);    // <<< sensors copied, 3 averages
+      assert (s_test_stat (msg, "shm.failures") == 0);
+      //  each stream on its lane, none was ever cut short
+      assert (s_test_stat (msg, "lane.metrics.backlog_max") >= 1);
+      assert (s_test_stat (msg, "lane.assets.backlog_max") >= 1);
+      assert (s_test_stat (msg, "lane.metrics.yields") == 0);
+      assert (s_test_stat (msg, "lane.assets.yields") == 0);
+      //  consuming from HM1 and HM2 only, patterns added to the first ones
+      assert (s_test_stat (msg, "subscription.devices") == 2);
+      assert (s_test_stat (msg, "subscription.resets") == 0);
+      //  every metric went through, each of the first three changed the average
+      assert (s_test_stat (msg, "latency.sensor_to_ingest_ms.count") == 4);
+      assert (s_test_stat (msg, "latency.ingest_to_publish_ms.count") == 3);
+      //  one tick after ingest, 5 s of virtual time
+      assert (s_test_stat (msg, "latency.ingest_to_publish_ms.p50") >= 5000);
+      assert (s_test_stat (msg, "latency.ingest_to_publish_ms.p999") <= 5000 + 5000 / 64);
+      zmsg_destroy (&msg);
+    }
+
+    //  the value held back by the deadband does not count for the next
+    //  average written, (70 + 110) / 2 = 90 one tick after its own ingest
+    {
+      aux = zhash_new ();
+      zhash_autofree (aux);
+      zhash_insert (aux, "sname", (void *) "sensor-2");
+      msg = fty_proto_encode_metric (aux, ::time (NULL), 60, "humidity.0", "HM2", "110", "%");
+      zhash_destroy (&aux);
+      mlm_client_send (producer_m, "humidity.0@HM2", &msg);
+      s_test_tick (ambient_location, "sensor-2", "110.00");
+
+      fty::shm::shmMetrics resultT;
+      fty::shm::read_metrics("datacenter-1", ".*humidity", resultT);
+      m = resultT.get(0);
+      assert (m);
+      assert (streq (fty_proto_value (m), "90.00"));
       m = NULL;
+      zstr_send (ambient_location, "STATS");
+      msg = zmsg_recv (ambient_location);
+      char *command = zmsg_popstr (msg);
+      assert (command && streq (command, "STATS"));
+      zstr_free (&command);
+      assert (s_test_stat (msg, "latency.ingest_to_publish_ms.count") == 4);
+      assert (s_test_stat (msg, "latency.ingest_to_publish_ms.max") <= 5000 + 5000 / 64);
+      zmsg_destroy (&msg);
     }
 
     zactor_destroy (&ambient_location);
+
+    //  replay what was recorded, without broker: a fresh agent publishes
+    //  the last average, stamped with the virtual time
+    {
+        fty_shm_delete_test_dir();
+        fty_shm_set_test_dir(shm_dir.c_str ());
+        AmbientRecording recording;
+        assert (recording.open (record_path.c_str ()) == 0);
+        //  topology and values files the replay must neither load nor overwrite
+        {
+            AmbientTopology stored;
+            stored.add_datacenter (stored.intern ("datacenter-9"));
+            assert (AmbientStore::save_topology (topology_path.c_str (), stored, std::vector<uint32_t> (1, 0)) == 0);
+            ambient_stored_value_t value;
+            value.name = "sensor-1";
+            value.type = AMBIENT_LOCATION_TYPE_HUMIDITY;
+            value.value = 10;
+            value.valid_till = ::time (NULL) + 3600;
+            value.ttl = 60;
+            assert (AmbientStore::save_values (values_path.c_str (), std::vector<ambient_stored_value_t> (1, value)) == 0);
+        }
+        zactor_t *replay = zactor_new (fty_ambient_location_server, NULL);
+        zstr_sendx (replay, "CONFIG", config_path.c_str (), NULL);
+        time_t start = ::time (NULL) + 30;
+        zstr_sendx (replay, "SIMULATE", std::to_string (start).c_str (), "5", NULL);
+        zstr_sendx (replay, "START", NULL);
+        int64_t time;
+        std::string stream;
+        int records = 0;
+        while (recording.read (time, stream, &msg) == 1) {
+            zmsg_pushstr (msg, stream.c_str ());
+            zmsg_pushstr (msg, "STREAM");
+            zmsg_send (&msg, replay);
+            records++;
+        }
+        assert (records >= 8);    // <<< 3 assets, 5 metrics
+        s_test_tick (replay, NULL, NULL);
+
+        fty::shm::shmMetrics resultT;
+        fty::shm::read_metrics("datacenter-1", ".*humidity", resultT);
+        m = resultT.get(0);
+        assert (m);
+        assert (streq (fty_proto_value (m), "90.00"));
+        assert (fty_proto_time (m) == uint64_t (start + 5));
+        zstr_send (replay, "STATS");
+        msg = zmsg_recv (replay);
+        char *command = zmsg_popstr (msg);
+        assert (command && streq (command, "STATS"));
+        zstr_free (&command);
+        assert (s_test_stat (msg, "topology.datacenters") == 1);
+        assert (s_test_stat (msg, "cache.restored") == 0);
+        zmsg_destroy (&msg);
+        zactor_destroy (&replay);
+        unlink (record_path.c_str ());
+        AmbientTopology stored;
+        std::vector<uint32_t> attributes;
+        assert (AmbientStore::load_topology (topology_path.c_str (), stored, attributes) == 0);
+        assert (stored.size () == 1 && stored.find ("datacenter-9") != AmbientTopology::NONE);
+        std::vector<ambient_stored_value_t> values;
+        assert (AmbientStore::load_values (values_path.c_str (), values) == 0);
+        assert (values.size () == 1 && values[0].name == "sensor-1" && values[0].value == 10);
+        unlink (topology_path.c_str ());
+        unlink (values_path.c_str ());
+    }
+
+    //  restart on the topology and sensor values saved by a first agent, on
+    //  real time since the stores are off in simulation: without broker
+    //  nothing reconciles them, one metric is enough to publish again and
+    //  sensor-1 still has its last value
+    {
+        fty_shm_delete_test_dir();
+        fty_shm_set_test_dir(shm_dir.c_str ());
+        unlink (topology_path.c_str ());
+        unlink (values_path.c_str ());
+        zactor_t *saving = zactor_new (fty_ambient_location_server, NULL);
+        zstr_sendx (saving, "CONFIG", config_path.c_str (), NULL);
+        zstr_sendx (saving, "START", NULL);
+        s_test_stream (saving, FTY_PROTO_STREAM_ASSETS, s_encode_asset ("datacenter-1", "datacenter", "N_A", "", NULL));
+        s_test_stream (saving, FTY_PROTO_STREAM_ASSETS, s_encode_asset ("sensor-1", "device", "sensor", "datacenter-1", "input"));
+        s_test_stream (saving, FTY_PROTO_STREAM_ASSETS, s_encode_asset ("sensor-2", "device", "sensor", "datacenter-1", "input"));
+        s_test_stream (saving, FTY_PROTO_STREAM_METRICS_SENSOR, s_test_metric ("sensor-1", "70"));
+        s_test_stream (saving, FTY_PROTO_STREAM_METRICS_SENSOR, s_test_metric ("sensor-2", "100"));
+        //  the startup load ends 2 s after the last asset
+        assert (s_test_wait_value ("datacenter-1", "average.humidity-input", "85.00", 5000));
+        zactor_destroy (&saving);
+
+        fty_shm_delete_test_dir();
+        fty_shm_set_test_dir(shm_dir.c_str ());
+        zactor_t *restarted = zactor_new (fty_ambient_location_server, NULL);
+        zstr_sendx (restarted, "CONFIG", config_path.c_str (), NULL);
+        zstr_sendx (restarted, "START", NULL);
+        s_test_stream (restarted, FTY_PROTO_STREAM_METRICS_SENSOR, s_test_metric ("sensor-2", "60"));
+        assert (s_test_wait_value ("datacenter-1", "average.humidity-input", "65.00", 5000));    // <<< (70 + 60) / 2
+
+        zstr_send (restarted, "STATS");
+        msg = zmsg_recv (restarted);
+        char *command = zmsg_popstr (msg);
+        assert (command && streq (command, "STATS"));
+        zstr_free (&command);
+        assert (s_test_stat (msg, "topology.sensors") == 2);
+        assert (s_test_stat (msg, "assets.received") == 0);
+        assert (s_test_stat (msg, "cache.restored") == 2);
+        zmsg_destroy (&msg);
+        zactor_destroy (&restarted);
+        unlink (topology_path.c_str ());
+        unlink (values_path.c_str ());
+    }
+
+    //  event-driven mode, on real time: a sensor update is published after
+    //  the debounce of the configuration, well before the next periodic
+    //  calculation
+    {
+        fty_shm_delete_test_dir();
+        fty_shm_set_test_dir(shm_dir.c_str ());
+        zactor_t *events = zactor_new (fty_ambient_location_server, NULL);
+        zstr_sendx (events, "CONFIG", config_path.c_str (), NULL);
+        zstr_sendx (events, "START", NULL);
+
+        aux = zhash_new ();
+        zhash_autofree (aux);
+        zhash_insert (aux, "status", (void *) "active");
+        zhash_insert (aux, "type", (void *) "datacenter");
+        zhash_insert (aux, "subtype", (void *) "N_A");
+        msg = fty_proto_encode_asset (aux, "datacenter-1", FTY_PROTO_ASSET_OP_CREATE, NULL);
+        zmsg_pushstr (msg, FTY_PROTO_STREAM_ASSETS);
+        zmsg_pushstr (msg, "STREAM");
+        zmsg_send (&msg, events);
+        zhash_insert (aux, "type", (void *) "device");
+        zhash_insert (aux, "subtype", (void *) "sensor");
+        ext = zhash_new ();
+        zhash_autofree (ext);
+        zhash_insert (ext, "logical_asset", (void *) "datacenter-1");
+        zhash_insert (ext, "sensor_function", (void *) "input");
+        msg = fty_proto_encode_asset (aux, "sensor-1", FTY_PROTO_ASSET_OP_CREATE, ext);
+        zhash_destroy (&ext);
+        zhash_destroy (&aux);
+        zmsg_pushstr (msg, FTY_PROTO_STREAM_ASSETS);
+        zmsg_pushstr (msg, "STREAM");
+        zmsg_send (&msg, events);
+        //  topology published once the assets settle, then the first
+        //  periodic calculation
+        zclock_sleep (2500);
+
+        aux = zhash_new ();
+        zhash_autofree (aux);
+        zhash_insert (aux, "sname", (void *) "sensor-1");
+        msg = fty_proto_encode_metric (aux, ::time (NULL), 60, "humidity.0", "HM1", "55", "%");
+        zhash_destroy (&aux);
+        zmsg_pushstr (msg, FTY_PROTO_STREAM_METRICS_SENSOR);
+        zmsg_pushstr (msg, "STREAM");
+        zmsg_send (&msg, events);
+        int64_t sent = zclock_mono ();
+
+        bool published = false;
+        while (!published && zclock_mono () - sent < 5000) {
+            fty::shm::shmMetrics resultT;
+            fty::shm::read_metrics("datacenter-1", "average.humidity-input", resultT);
+            published = resultT.size () > 0 && streq (fty_proto_value (resultT.get (0)), "55.00");
+            zclock_sleep (1);
+        }
+        assert (published);
+
+        zstr_send (events, "STATS");
+        msg = zmsg_recv (events);
+        char *command = zmsg_popstr (msg);
+        assert (command && streq (command, "STATS"));
+        zstr_free (&command);
+        assert (s_test_stat (msg, "cycles.event") >= 1);
+        zmsg_destroy (&msg);
+        zactor_destroy (&events);
+        unlink (topology_path.c_str ());
+        unlink (values_path.c_str ());
+    }
+
+    //  sensor metrics read in shm instead of the stream: each TICK reads
+    //  them, a value read already is not ingested again, and its *.default
+    //  copy is written but not read back
+    {
+        fty_shm_delete_test_dir();
+        fty_shm_set_test_dir(shm_dir.c_str ());
+        std::string ingest_path = std::string (SELFTEST_DIR_RW) + "/server-ingest.cfg";
+        zconfig_t *config = zconfig_new ("root", NULL);
+        zconfig_put (config, "ingest/backend", "shm");
+        zconfig_save (config, ingest_path.c_str ());
+        zconfig_destroy (&config);
+        zactor_t *reader = zactor_new (fty_ambient_location_server, NULL);
+        zstr_sendx (reader, "CONFIG", ingest_path.c_str (), NULL);
+        zstr_sendx (reader, "SIMULATE", "0", "5", NULL);
+        zstr_sendx (reader, "START", NULL);
+
+        aux = zhash_new ();
+        zhash_autofree (aux);
+        zhash_insert (aux, "status", (void *) "active");
+        zhash_insert (aux, "type", (void *) "datacenter");
+        zhash_insert (aux, "subtype", (void *) "N_A");
+        msg = fty_proto_encode_asset (aux, "datacenter-1", FTY_PROTO_ASSET_OP_CREATE, NULL);
+        zmsg_pushstr (msg, FTY_PROTO_STREAM_ASSETS);
+        zmsg_pushstr (msg, "STREAM");
+        zmsg_send (&msg, reader);
+        zhash_insert (aux, "type", (void *) "device");
+        zhash_insert (aux, "subtype", (void *) "sensor");
+        ext = zhash_new ();
+        zhash_autofree (ext);
+        zhash_insert (ext, "logical_asset", (void *) "datacenter-1");
+        zhash_insert (ext, "sensor_function", (void *) "input");
+        msg = fty_proto_encode_asset (aux, "sensor-1", FTY_PROTO_ASSET_OP_CREATE, ext);
+        zhash_destroy (&ext);
+        zhash_destroy (&aux);
+        zmsg_pushstr (msg, FTY_PROTO_STREAM_ASSETS);
+        zmsg_pushstr (msg, "STREAM");
+        zmsg_send (&msg, reader);
+
+        fty::shm::write_metric ("sensor-1", "humidity.0", "45", "%", 60);
+        fty::shm::write_metric ("sensor-1", "humidity.default", "90", "%", 60);
+        s_test_tick (reader, NULL, NULL);
+        s_test_tick (reader, NULL, NULL);
+
+        fty::shm::shmMetrics resultT;
+        fty::shm::read_metrics("datacenter-1", "average.humidity-input", resultT);
+        assert (resultT.size () == 1);
+        assert (streq (fty_proto_value (resultT.get (0)), "45.00"));
+        fty::shm::shmMetrics copies;
+        fty::shm::read_metrics("sensor-1", "humidity.default", copies);
+        assert (copies.size () == 1);
+        assert (streq (fty_proto_value (copies.get (0)), "45.00"));
+
+        zstr_send (reader, "STATS");
+        msg = zmsg_recv (reader);
+        char *command = zmsg_popstr (msg);
+        assert (command && streq (command, "STATS"));
+        zstr_free (&command);
+        assert (s_test_stat (msg, "ingest.reads") >= 2);
+        assert (s_test_stat (msg, "metrics.received") == 1);
+        assert (s_test_stat (msg, "cache.updates") == 1);
+        zmsg_destroy (&msg);
+        zactor_destroy (&reader);
+        unlink (ingest_path.c_str ());
+    }
+
     mlm_client_destroy (&producer);
     mlm_client_destroy (&producer_m);
     zactor_destroy (&server);
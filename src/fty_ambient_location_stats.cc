@@ -0,0 +1,160 @@
+/*  =========================================================================
+    fty_ambient_location_stats - Runtime counters and gauges of the agent
+
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+
+/*
+@header
+    fty_ambient_location_stats - Runtime counters and gauges of the agent
+@discuss
+    Statistics are shared atomic counters: updating one is a single
+    relaxed atomic operation (fetch_add, store or compare-exchange), with
+    no lock. Most are updated by one actor only, but some by both of them
+    (shm.writes and shm.failures, lock.contended and lock.wait_us), whose
+    updates then contend for the same cache line.
+    The server reports them on STATS requests, from its mailbox or its
+    pipe, and can write them in shared memory (stats/publish).
+@end
+*/
+
+#include "fty_metric_ambient_location_classes.h"
+#include <cinttypes>
+#include <thread>
+
+static const char *s_names[AMBIENT_STAT_COUNT] = {
+  "metrics.received",
+  "metrics.ignored",
+  "metrics.coalesced",
+  "stream.wakeups",
+  "lane.metrics.backlog",
+  "lane.metrics.backlog_max",
+  "lane.metrics.yields",
+  "lane.assets.backlog",
+  "lane.assets.backlog_max",
+  "lane.assets.yields",
+  "subscription.devices",
+  "subscription.resets",
+  "ingest.reads",
+  "ingest.read_us",
+  "assets.received",
+  "assets.ignored",
+  "messages.ignored",
+  "cache.updates",
+  "lock.contended",
+  "lock.wait_us",
+  "topology.version",
+  "topology.nodes",
+  "topology.sensors",
+  "topology.datacenters",
+  "startup.assets",
+  "startup.ms",
+  "cache.restored",
+  "cache.expired",
+  "cycles",
+  "cycles.event",
+  "cycle.us",
+  "cycle.max_us",
+  "cycle.total_us",
+  "shm.writes",
+  "shm.failures",
+  "shm.suppressed"
+};
+
+AmbientStats::AmbientStats ()
+{
+  for (auto &value : m_values)
+    value.store (0);
+}
+
+void AmbientStats::raise (ambient_stat_t stat, uint64_t value)
+{
+  uint64_t current = m_values[stat].load (std::memory_order_relaxed);
+  while (value > current && !m_values[stat].compare_exchange_weak (current, value, std::memory_order_relaxed))
+    ;
+}
+
+const char *AmbientStats::name (ambient_stat_t stat)
+{
+  return stat < AMBIENT_STAT_COUNT ? s_names[stat] : "";
+}
+
+void AmbientStats::append (zmsg_t *message) const
+{
+  for (int stat = 0; stat < AMBIENT_STAT_COUNT; stat++) {
+    zmsg_addstr (message, s_names[stat]);
+    zmsg_addstrf (message, "%" PRIu64, get (ambient_stat_t (stat)));
+  }
+}
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+void
+fty_ambient_location_stats_test (bool verbose)
+{
+    printf (" * fty_ambient_location_stats: ");
+
+    //  @selftest
+    AmbientStats stats;
+    for (int stat = 0; stat < AMBIENT_STAT_COUNT; stat++) {
+        assert (stats.get (ambient_stat_t (stat)) == 0);
+        assert (strlen (AmbientStats::name (ambient_stat_t (stat))) > 0);
+        for (int other = 0; other < stat; other++)
+            assert (!streq (AmbientStats::name (ambient_stat_t (stat)), AmbientStats::name (ambient_stat_t (other))));
+    }
+    stats.add (AMBIENT_STAT_METRICS_RECEIVED);
+    stats.add (AMBIENT_STAT_METRICS_RECEIVED, 41);
+    assert (stats.get (AMBIENT_STAT_METRICS_RECEIVED) == 42);
+    stats.set (AMBIENT_STAT_CYCLE_US, 10);
+    stats.set (AMBIENT_STAT_CYCLE_US, 7);
+    assert (stats.get (AMBIENT_STAT_CYCLE_US) == 7);
+    stats.raise (AMBIENT_STAT_CYCLE_MAX_US, 10);
+    stats.raise (AMBIENT_STAT_CYCLE_MAX_US, 7);
+    assert (stats.get (AMBIENT_STAT_CYCLE_MAX_US) == 10);
+
+    //  one writer per counter, readers on other threads
+    {
+        std::thread writer ([&] {
+            for (int i = 0; i < 100000; i++)
+                stats.add (AMBIENT_STAT_CACHE_UPDATES);
+        });
+        uint64_t previous = 0;
+        for (int i = 0; i < 1000; i++) {
+            uint64_t value = stats.get (AMBIENT_STAT_CACHE_UPDATES);
+            assert (value >= previous);
+            previous = value;
+        }
+        writer.join ();
+        assert (stats.get (AMBIENT_STAT_CACHE_UPDATES) == 100000);
+    }
+
+    zmsg_t *message = zmsg_new ();
+    stats.append (message);
+    assert (zmsg_size (message) == 2 * AMBIENT_STAT_COUNT);
+    char *name = zmsg_popstr (message);
+    char *value = zmsg_popstr (message);
+    assert (streq (name, "metrics.received") && streq (value, "42"));
+    zstr_free (&name);
+    zstr_free (&value);
+    zmsg_destroy (&message);
+    //  @end
+    printf ("OK\n");
+}
@@ -0,0 +1,453 @@
+/*  =========================================================================
+    fty_ambient_location_store - Files keeping the topology and sensor values across restarts
+
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+
+/*
+@header
+    fty_ambient_location_store - Files keeping the topology and sensor values across restarts
+@discuss
+    The server saves its topology on each new version and when it stops,
+    then loads it at startup so the calculation starts at once, before
+    the answer to REPUBLISH reconciles it. A file is written next to its
+    destination, synced to disk then renamed over it, so neither a crash
+    nor a power loss leaves half a file.
+    It is mapped when loaded and checked completely before the topology
+    is touched.
+
+    The calculation also saves the sensor values it holds periodically
+    and when it stops. They are loaded before the first calculation, those
+    which expired meanwhile are dropped by the server.
+@end
+*/
+
+#include "fty_metric_ambient_location_classes.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define TOPOLOGY_MAGIC "FTYAMBT1"
+#define STORE_MAGIC_SIZE 8
+#define TOPOLOGY_HEADER_SIZE (STORE_MAGIC_SIZE + 16)
+#define TOPOLOGY_RECORD_SIZE 16
+#define VALUES_MAGIC "FTYAMBV1"
+#define VALUES_HEADER_SIZE (STORE_MAGIC_SIZE + 8)
+#define VALUES_RECORD_SIZE 32
+
+static void
+s_put (std::string &buffer, uint32_t value)
+{
+  for (int i = 0; i < 4; i++)
+    buffer.push_back (char ((value >> (8 * i)) & 0xff));
+}
+
+static void
+s_put64 (std::string &buffer, uint64_t value)
+{
+  s_put (buffer, uint32_t (value));
+  s_put (buffer, uint32_t (value >> 32));
+}
+
+static uint32_t
+s_get (const unsigned char *data)
+{
+  return uint32_t (data[0]) | uint32_t (data[1]) << 8 | uint32_t (data[2]) << 16 | uint32_t (data[3]) << 24;
+}
+
+static uint64_t
+s_get64 (const unsigned char *data)
+{
+  return uint64_t (s_get (data)) | uint64_t (s_get (data + 4)) << 32;
+}
+
+//  Read-only mapping of a whole file
+class AmbientMapping{
+  public :
+    AmbientMapping () : m_data (NULL), m_size (0) {}
+    ~AmbientMapping ()
+    {
+      if (m_data)
+        munmap (m_data, m_size);
+    }
+    int open (const char *path)
+    {
+      int fd = ::open (path, O_RDONLY);
+      if (fd == -1)
+        return -1;
+      struct stat info;
+      if (fstat (fd, &info) == 0 && info.st_size > 0) {
+        m_size = size_t (info.st_size);
+        void *data = mmap (NULL, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        m_data = data == MAP_FAILED ? NULL : data;
+      }
+      ::close (fd);
+      return m_data ? 0 : -1;
+    }
+    const unsigned char *data () const { return (const unsigned char *) m_data; }
+    size_t size () const { return m_size; }
+
+  private :
+    void *m_data;
+    size_t m_size;
+};
+
+//  Write content to path through a temporary file renamed over it
+static int
+s_replace (const char *path, const std::string &content)
+{
+  std::string temporary = std::string (path) + ".tmp";
+  FILE *file = fopen (temporary.c_str (), "wb");
+  if (!file) {
+    log_error ("Cannot create %s: %s", temporary.c_str (), strerror (errno));
+    return -1;
+  }
+  bool written = fwrite (content.data (), 1, content.size (), file) == content.size ();
+  //on disk before the rename, which a power loss could otherwise leave
+  //pointing to an empty file
+  written = written && fflush (file) == 0 && fsync (fileno (file)) == 0;
+  if (fclose (file) != 0 || !written || rename (temporary.c_str (), path) != 0) {
+    log_error ("Cannot write %s: %s", path, strerror (errno));
+    unlink (temporary.c_str ());
+    return -1;
+  }
+  return 0;
+}
+
+int AmbientStore::save_topology (const char *path, const AmbientTopology &topology,
+    const std::vector<uint32_t> &attributes)
+{
+  size_t size = topology.size ();
+  std::string names;
+  std::string content (TOPOLOGY_MAGIC, STORE_MAGIC_SIZE);
+  content.reserve (TOPOLOGY_HEADER_SIZE + size * TOPOLOGY_RECORD_SIZE + topology.datacenters ().size () * 4);
+  s_put (content, uint32_t (size));
+  s_put (content, uint32_t (topology.datacenters ().size ()));
+  size_t names_size = 0;
+  for (asset_id_t id = 0; id < size; id++)
+    names_size += topology.name (id).size ();
+  s_put (content, uint32_t (names_size));
+  s_put (content, 0);
+  names.reserve (names_size);
+  for (asset_id_t id = 0; id < size; id++) {
+    s_put (content, topology.parent (id));
+    s_put (content, uint32_t (names.size ()));
+    s_put (content, uint32_t (topology.name (id).size ()));
+    s_put (content, id < attributes.size () ? attributes[id] : 0);
+    names.append (topology.name (id));
+  }
+  for (asset_id_t id : topology.datacenters ())
+    s_put (content, id);
+  content.append (names);
+  return s_replace (path, content);
+}
+
+int AmbientStore::load_topology (const char *path, AmbientTopology &topology,
+    std::vector<uint32_t> &attributes)
+{
+  assert (topology.size () == 0);
+  AmbientMapping mapping;
+  if (mapping.open (path) != 0)
+    return -1;
+  const unsigned char *data = mapping.data ();
+  size_t size = mapping.size ();
+  if (size < TOPOLOGY_HEADER_SIZE || memcmp (data, TOPOLOGY_MAGIC, STORE_MAGIC_SIZE) != 0) {
+    log_error ("%s is not a topology file", path);
+    return -1;
+  }
+  uint64_t assets = s_get (data + 8);
+  uint64_t datacenters = s_get (data + 12);
+  uint64_t names_size = s_get (data + 16);
+  const unsigned char *records = data + TOPOLOGY_HEADER_SIZE;
+  const unsigned char *dcs = records + assets * TOPOLOGY_RECORD_SIZE;
+  const char *names = (const char *) (dcs + datacenters * 4);
+  if (TOPOLOGY_HEADER_SIZE + assets * TOPOLOGY_RECORD_SIZE + datacenters * 4 + names_size != size) {
+    log_error ("%s is truncated", path);
+    return -1;
+  }
+
+  //check everything first, the topology would not accept a dangling id
+  for (uint64_t id = 0; id < assets; id++) {
+    const unsigned char *record = records + id * TOPOLOGY_RECORD_SIZE;
+    uint32_t parent = s_get (record);
+    uint64_t offset = s_get (record + 4);
+    uint64_t length = s_get (record + 8);
+    if ((parent != AmbientTopology::NONE && parent >= assets) || offset + length > names_size) {
+      log_error ("%s is corrupted", path);
+      return -1;
+    }
+  }
+  for (uint64_t i = 0; i < datacenters; i++) {
+    if (s_get (dcs + i * 4) >= assets) {
+      log_error ("%s is corrupted", path);
+      return -1;
+    }
+  }
+
+  AmbientTopology loaded;
+  for (uint64_t id = 0; id < assets; id++) {
+    const unsigned char *record = records + id * TOPOLOGY_RECORD_SIZE;
+    //a name saved twice would shift the ids of the next ones
+    if (loaded.intern (std::string (names + s_get (record + 4), s_get (record + 8))) != id) {
+      log_error ("%s is corrupted", path);
+      return -1;
+    }
+  }
+  std::vector<uint32_t> loaded_attributes (assets);
+  for (uint64_t id = 0; id < assets; id++) {
+    const unsigned char *record = records + id * TOPOLOGY_RECORD_SIZE;
+    uint32_t parent = s_get (record);
+    //a cycle would never end the walks up the hierarchy
+    if (parent != AmbientTopology::NONE && loaded.attach (asset_id_t (id), parent) == id) {
+      log_error ("%s is corrupted", path);
+      return -1;
+    }
+    loaded_attributes[id] = s_get (record + 12);
+  }
+  for (uint64_t i = 0; i < datacenters; i++)
+    loaded.add_datacenter (s_get (dcs + i * 4));
+  topology = std::move (loaded);
+  attributes.swap (loaded_attributes);
+  return 0;
+}
+
+int AmbientStore::save_values (const char *path, const std::vector<ambient_stored_value_t> &values)
+{
+  size_t names_size = 0;
+  for (const auto &value : values)
+    names_size += value.name.size ();
+  std::string content (VALUES_MAGIC, STORE_MAGIC_SIZE);
+  content.reserve (VALUES_HEADER_SIZE + values.size () * VALUES_RECORD_SIZE + names_size);
+  s_put (content, uint32_t (values.size ()));
+  s_put (content, uint32_t (names_size));
+  size_t offset = 0;
+  for (const auto &value : values) {
+    uint64_t bits;
+    memcpy (&bits, &value.value, sizeof (bits));
+    s_put (content, uint32_t (offset));
+    s_put (content, uint32_t (value.name.size ()));
+    s_put (content, value.type);
+    s_put (content, value.ttl);
+    s_put64 (content, uint64_t (value.valid_till));
+    s_put64 (content, bits);
+    offset += value.name.size ();
+  }
+  for (const auto &value : values)
+    content.append (value.name);
+  return s_replace (path, content);
+}
+
+int AmbientStore::load_values (const char *path, std::vector<ambient_stored_value_t> &values)
+{
+  AmbientMapping mapping;
+  if (mapping.open (path) != 0)
+    return -1;
+  const unsigned char *data = mapping.data ();
+  size_t size = mapping.size ();
+  if (size < VALUES_HEADER_SIZE || memcmp (data, VALUES_MAGIC, STORE_MAGIC_SIZE) != 0) {
+    log_error ("%s is not a values file", path);
+    return -1;
+  }
+  uint64_t count = s_get (data + 8);
+  uint64_t names_size = s_get (data + 12);
+  if (VALUES_HEADER_SIZE + count * VALUES_RECORD_SIZE + names_size != size) {
+    log_error ("%s is truncated", path);
+    return -1;
+  }
+  const unsigned char *records = data + VALUES_HEADER_SIZE;
+  const char *names = (const char *) (records + count * VALUES_RECORD_SIZE);
+
+  std::vector<ambient_stored_value_t> loaded (count);
+  for (uint64_t i = 0; i < count; i++) {
+    const unsigned char *record = records + i * VALUES_RECORD_SIZE;
+    uint64_t offset = s_get (record);
+    uint64_t length = s_get (record + 4);
+    if (offset + length > names_size) {
+      log_error ("%s is corrupted", path);
+      return -1;
+    }
+    ambient_stored_value_t &value = loaded[i];
+    value.name.assign (names + offset, length);
+    value.type = s_get (record + 8);
+    value.ttl = s_get (record + 12);
+    value.valid_till = int64_t (s_get64 (record + 16));
+    uint64_t bits = s_get64 (record + 24);
+    memcpy (&value.value, &bits, sizeof (bits));
+  }
+  values.swap (loaded);
+  return 0;
+}
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+void
+fty_ambient_location_store_test (bool verbose)
+{
+    printf (" * fty_ambient_location_store: ");
+
+    //  @selftest
+    //  Note: If your selftest reads SCMed fixture data, please keep it in
+    //  src/selftest-ro; if your test creates filesystem objects, please
+    //  do so under src/selftest-rw.
+    const char *SELFTEST_DIR_RW = "src/selftest-rw";
+    std::string path = std::string (SELFTEST_DIR_RW) + "/topology.bin";
+
+    AmbientTopology topology;
+    std::vector<uint32_t> attributes;
+    asset_id_t dc = topology.intern ("datacenter-1");
+    asset_id_t room = topology.intern ("room-1");
+    asset_id_t rack = topology.intern ("rack-1");
+    asset_id_t sensor = topology.intern ("sensor-1");
+    asset_id_t detached = topology.intern ("rack-2");
+    assert (topology.add_datacenter (dc));
+    topology.attach (room, dc);
+    topology.attach (rack, room);
+    topology.attach (sensor, rack);
+    attributes.assign (topology.size (), 0);
+    attributes[sensor] = 0x1234;
+    assert (AmbientStore::save_topology (path.c_str (), topology, attributes) == 0);
+
+    {
+        AmbientTopology loaded;
+        std::vector<uint32_t> loaded_attributes;
+        assert (AmbientStore::load_topology (path.c_str (), loaded, loaded_attributes) == 0);
+        assert (loaded.size () == 5);
+        assert (loaded.find ("sensor-1") == sensor);
+        assert (loaded.name (detached) == "rack-2");
+        assert (loaded.parent (sensor) == rack);
+        assert (loaded.parent (rack) == room);
+        assert (loaded.parent (room) == dc);
+        assert (loaded.parent (dc) == AmbientTopology::NONE);
+        assert (loaded.parent (detached) == AmbientTopology::NONE);
+        assert (loaded.datacenters ().size () == 1 && loaded.is_datacenter (dc));
+        assert (loaded_attributes.size () == 5 && loaded_attributes[sensor] == 0x1234);
+
+        //the relations of a loaded topology still change as usual
+        assert (loaded.attach (detached, room) == AmbientTopology::NONE);
+        assert (loaded.detach (sensor));
+        AmbientHierarchy hierarchy;
+        loaded.compile (hierarchy);
+        assert (hierarchy.children_end (room) - hierarchy.children_begin (room) == 2);
+        assert (hierarchy.children_begin (rack) == hierarchy.children_end (rack));
+    }
+
+    //  an empty topology
+    {
+        AmbientTopology empty, loaded;
+        std::vector<uint32_t> loaded_attributes (3, 1);
+        std::string empty_path = std::string (SELFTEST_DIR_RW) + "/topology-empty.bin";
+        assert (AmbientStore::save_topology (empty_path.c_str (), empty, std::vector<uint32_t> ()) == 0);
+        assert (AmbientStore::load_topology (empty_path.c_str (), loaded, loaded_attributes) == 0);
+        assert (loaded.size () == 0 && loaded_attributes.empty ());
+        unlink (empty_path.c_str ());
+    }
+
+    //  missing, truncated and corrupted files leave the topology untouched
+    {
+        AmbientTopology loaded;
+        std::vector<uint32_t> loaded_attributes;
+        assert (AmbientStore::load_topology ((std::string (SELFTEST_DIR_RW) + "/missing.bin").c_str (),
+            loaded, loaded_attributes) == -1);
+
+        FILE *file = fopen (path.c_str (), "rb");
+        std::string content;
+        char buffer[256];
+        size_t got;
+        while ((got = fread (buffer, 1, sizeof (buffer), file)) > 0)
+            content.append (buffer, got);
+        fclose (file);
+
+        file = fopen (path.c_str (), "wb");
+        fwrite (content.data (), 1, content.size () - 1, file);
+        fclose (file);
+        assert (AmbientStore::load_topology (path.c_str (), loaded, loaded_attributes) == -1);
+
+        //parent of the first asset out of range
+        std::string corrupted = content;
+        corrupted[TOPOLOGY_HEADER_SIZE] = 42;
+        corrupted[TOPOLOGY_HEADER_SIZE + 1] = corrupted[TOPOLOGY_HEADER_SIZE + 2] = corrupted[TOPOLOGY_HEADER_SIZE + 3] = 0;
+        file = fopen (path.c_str (), "wb");
+        fwrite (corrupted.data (), 1, corrupted.size (), file);
+        fclose (file);
+        assert (AmbientStore::load_topology (path.c_str (), loaded, loaded_attributes) == -1);
+
+        //the datacenter below its own rack, a cycle
+        corrupted = content;
+        corrupted[TOPOLOGY_HEADER_SIZE] = char (rack);
+        file = fopen (path.c_str (), "wb");
+        fwrite (corrupted.data (), 1, corrupted.size (), file);
+        fclose (file);
+        assert (AmbientStore::load_topology (path.c_str (), loaded, loaded_attributes) == -1);
+
+        //two assets with the same name
+        corrupted = content;
+        corrupted.replace (corrupted.size () - 6, 6, "room-1");
+        file = fopen (path.c_str (), "wb");
+        fwrite (corrupted.data (), 1, corrupted.size (), file);
+        fclose (file);
+        assert (AmbientStore::load_topology (path.c_str (), loaded, loaded_attributes) == -1);
+        assert (loaded.size () == 0 && loaded_attributes.empty ());
+    }
+    unlink (path.c_str ());
+
+    //  values
+    {
+        std::string values_path = std::string (SELFTEST_DIR_RW) + "/values.bin";
+        std::vector<ambient_stored_value_t> values (2);
+        values[0].name = "sensor-1";
+        values[0].type = 1;
+        values[0].value = 21.25;
+        values[0].valid_till = int64_t (1) << 33;
+        values[0].ttl = 300;
+        values[1].name = "sensor-22";
+        values[1].type = 0;
+        values[1].value = -0.1;
+        values[1].valid_till = 1000;
+        values[1].ttl = 60;
+        assert (AmbientStore::save_values (values_path.c_str (), values) == 0);
+
+        std::vector<ambient_stored_value_t> loaded (1);
+        assert (AmbientStore::load_values (values_path.c_str (), loaded) == 0);
+        assert (loaded.size () == 2);
+        for (size_t i = 0; i < 2; i++) {
+            assert (loaded[i].name == values[i].name);
+            assert (loaded[i].type == values[i].type);
+            assert (loaded[i].value == values[i].value);
+            assert (loaded[i].valid_till == values[i].valid_till);
+            assert (loaded[i].ttl == values[i].ttl);
+        }
+
+        //a name out of the file
+        FILE *file = fopen (values_path.c_str (), "r+b");
+        fseek (file, VALUES_HEADER_SIZE + VALUES_RECORD_SIZE, SEEK_SET);
+        fputc (100, file);
+        fclose (file);
+        assert (AmbientStore::load_values (values_path.c_str (), loaded) == -1);
+        assert (loaded.size () == 2);
+        //a topology is not a values file
+        assert (AmbientStore::save_topology (values_path.c_str (), topology, attributes) == 0);
+        assert (AmbientStore::load_values (values_path.c_str (), loaded) == -1);
+        unlink (values_path.c_str ());
+    }
+    //  @end
+    printf ("OK\n");
+}
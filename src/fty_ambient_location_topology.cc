@@ -0,0 +1,226 @@
+/*  =========================================================================
+    fty_ambient_location_topology - Interned asset hierarchy of the locations
+
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+/*
+@header
+    fty_ambient_location_topology - Interned asset hierarchy of the locations
+@discuss
+    Each asset name gets a dense integer id the first time it is seen. The
+    calculation then only deals with ids: parents in a flat array, children
+    in one contiguous array indexed by per-asset offsets. AmbientTopology is
+    updated in place by the asset messages, each compiled AmbientHierarchy
+    is immutable and can be read from another thread. Each asset knows its
+    position among its siblings and datacenters, so removing or moving it
+    is O(1): the last sibling takes its place.
+@end
+*/
+
+#include "fty_metric_ambient_location_classes.h"
+
+const asset_id_t AmbientTopology::NONE = UINT32_MAX;
+
+asset_id_t AmbientTopology::intern (const std::string &name)
+{
+  auto it = m_ids.find (name);
+  if (it != m_ids.end ())
+    return it->second;
+
+  asset_id_t id = asset_id_t (m_names.size ());
+  it = m_ids.emplace (name, id).first;
+  m_names.push_back (&it->first);
+  m_parents.push_back (NONE);
+  m_children.emplace_back ();
+  m_positions.push_back (0);
+  m_datacenter_positions.push_back (NONE);
+  return id;
+}
+
+asset_id_t AmbientTopology::find (const std::string &name) const
+{
+  auto it = m_ids.find (name);
+  return it == m_ids.end () ? NONE : it->second;
+}
+
+//  Remove the element at position from items, the last one taking its place
+//  and its position being updated
+static void
+s_swap_and_pop (std::vector<asset_id_t> &items, std::vector<uint32_t> &positions, uint32_t position)
+{
+  asset_id_t last = items.back ();
+  items[position] = last;
+  positions[last] = position;
+  items.pop_back ();
+}
+
+asset_id_t AmbientTopology::attach (asset_id_t id, asset_id_t parent)
+{
+  asset_id_t previous = m_parents[id];
+  if (previous == parent)
+    return previous;
+  //  the ancestors of parent, at most every asset since there is no cycle
+  asset_id_t ancestor = parent;
+  for (size_t steps = 0; ancestor != NONE && steps <= m_parents.size (); steps++) {
+    if (ancestor == id)
+      return id;
+    ancestor = m_parents[ancestor];
+  }
+  detach (id);
+  m_parents[id] = parent;
+  m_positions[id] = uint32_t (m_children[parent].size ());
+  m_children[parent].push_back (id);
+  return previous;
+}
+
+bool AmbientTopology::detach (asset_id_t id)
+{
+  asset_id_t parent = m_parents[id];
+  if (parent == NONE)
+    return false;
+  m_parents[id] = NONE;
+  s_swap_and_pop (m_children[parent], m_positions, m_positions[id]);
+  return true;
+}
+
+bool AmbientTopology::add_datacenter (asset_id_t id)
+{
+  if (is_datacenter (id))
+    return false;
+  m_datacenter_positions[id] = uint32_t (m_datacenters.size ());
+  m_datacenters.push_back (id);
+  return true;
+}
+
+bool AmbientTopology::remove_datacenter (asset_id_t id)
+{
+  if (!is_datacenter (id))
+    return false;
+  s_swap_and_pop (m_datacenters, m_datacenter_positions, m_datacenter_positions[id]);
+  m_datacenter_positions[id] = NONE;
+  return true;
+}
+
+void AmbientTopology::compile (AmbientHierarchy &hierarchy) const
+{
+  hierarchy.m_names = m_names;
+  hierarchy.m_parents = m_parents;
+  hierarchy.m_datacenters = m_datacenters;
+  hierarchy.m_child_offsets.resize (m_children.size () + 1);
+  hierarchy.m_child_ids.clear ();
+  for (size_t id = 0; id < m_children.size (); id++) {
+    hierarchy.m_child_offsets[id] = uint32_t (hierarchy.m_child_ids.size ());
+    hierarchy.m_child_ids.insert (hierarchy.m_child_ids.end (), m_children[id].begin (), m_children[id].end ());
+  }
+  hierarchy.m_child_offsets[m_children.size ()] = uint32_t (hierarchy.m_child_ids.size ());
+}
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+static std::vector<std::string>
+s_children_names (const AmbientHierarchy &hierarchy, asset_id_t id)
+{
+  std::vector<std::string> names;
+  for (const asset_id_t *child = hierarchy.children_begin (id); child != hierarchy.children_end (id); child++)
+    names.push_back (hierarchy.name (*child));
+  return names;
+}
+
+void
+fty_ambient_location_topology_test (bool verbose)
+{
+    printf (" * fty_ambient_location_topology: ");
+
+    //  @selftest
+    AmbientTopology topology;
+    asset_id_t dc = topology.intern ("datacenter-1");
+    asset_id_t room = topology.intern ("room-1");
+    asset_id_t rack1 = topology.intern ("rack-1");
+    asset_id_t rack2 = topology.intern ("rack-2");
+    asset_id_t sensor = topology.intern ("sensor-1");
+    assert (dc == 0 && sensor == 4);
+    assert (topology.intern ("room-1") == room);
+    assert (topology.find ("rack-2") == rack2);
+    assert (topology.find ("rack-3") == AmbientTopology::NONE);
+    assert (topology.name (rack1) == "rack-1");
+
+    topology.add_datacenter (dc);
+    topology.attach (room, dc);
+    topology.attach (rack1, room);
+    topology.attach (rack2, room);
+    topology.attach (sensor, rack1);
+    AmbientHierarchy hierarchy;
+    topology.compile (hierarchy);
+    assert (hierarchy.size () == 5);
+    assert (hierarchy.parent (sensor) == rack1);
+    assert (hierarchy.parent (dc) == AmbientTopology::NONE);
+    assert (hierarchy.datacenters () == std::vector<asset_id_t> ({dc}));
+    assert (s_children_names (hierarchy, room) == std::vector<std::string> ({"rack-1", "rack-2"}));
+    assert (s_children_names (hierarchy, rack2).empty ());
+
+    //  move the sensor to the other rack
+    assert (topology.attach (sensor, rack2) == rack1);
+    assert (topology.attach (sensor, rack2) == rack2);
+    //  an ancestor is never moved below one of its descendants
+    assert (topology.attach (room, rack2) == room);
+    assert (topology.attach (dc, sensor) == dc);
+    assert (topology.attach (rack1, rack1) == rack1);
+    assert (topology.parent (room) == dc);
+    assert (topology.parent (dc) == AmbientTopology::NONE);
+    assert (topology.parent (rack1) == room);
+    asset_id_t rack3 = topology.intern ("rack-3");
+    assert (topology.attach (rack3, room) == AmbientTopology::NONE);
+    AmbientHierarchy next;
+    topology.compile (next);
+    assert (s_children_names (next, rack1).empty ());
+    assert (s_children_names (next, rack2) == std::vector<std::string> ({"sensor-1"}));
+    assert (s_children_names (next, room) == std::vector<std::string> ({"rack-1", "rack-2", "rack-3"}));
+    assert (s_children_names (next, rack3).empty ());
+    //  previous versions are left untouched
+    assert (hierarchy.size () == 5);
+    assert (hierarchy.parent (sensor) == rack1);
+    assert (s_children_names (hierarchy, room) == std::vector<std::string> ({"rack-1", "rack-2"}));
+    assert (hierarchy.name (rack1) == "rack-1");
+
+    //  the last sibling takes the place of a removed one
+    assert (topology.detach (rack1));
+    assert (!topology.detach (rack1));
+    topology.compile (next);
+    assert (s_children_names (next, room) == std::vector<std::string> ({"rack-3", "rack-2"}));
+    assert (topology.detach (rack2));
+    assert (topology.detach (rack3));
+    topology.compile (next);
+    assert (s_children_names (next, room).empty ());
+
+    asset_id_t dc2 = topology.intern ("datacenter-2");
+    assert (!topology.add_datacenter (dc));
+    assert (topology.add_datacenter (dc2));
+    assert (topology.is_datacenter (dc) && topology.is_datacenter (dc2));
+    assert (topology.remove_datacenter (dc));
+    assert (!topology.remove_datacenter (dc));
+    assert (!topology.is_datacenter (dc));
+    assert (topology.datacenters () == std::vector<asset_id_t> ({dc2}));
+    assert (topology.remove_datacenter (dc2));
+    assert (topology.datacenters ().empty ());
+    //  @end
+
+    printf ("OK\n");
+}
@@ -0,0 +1,195 @@
+/*  =========================================================================
+    fty_ambient_location_wheel - Hierarchical timing wheel scheduling expirations
+
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+/*
+@header
+    fty_ambient_location_wheel - Hierarchical timing wheel scheduling expirations
+@discuss
+    Four levels of 64 slots cover about 194 days ahead with a one second
+    resolution, farther timers wait in an overflow list. When the wheel
+    crosses the boundary of a level, the timers of the slot reached are
+    placed again in the lower levels. Ticks where nothing can fire are
+    skipped, so a long advance costs one step per non empty level window.
+@end
+*/
+
+#include "fty_metric_ambient_location_classes.h"
+#include <algorithm>
+
+AmbientTimingWheel::AmbientTimingWheel (time_t now) :
+  m_now (now),
+  m_size (0)
+{
+  std::fill (m_counts, m_counts + LEVELS, 0);
+}
+
+void AmbientTimingWheel::place (const expiry_t &timer)
+{
+  if (timer.deadline <= m_now) {
+    m_due.push_back (timer);
+    return;
+  }
+  for (int level = 0; level < LEVELS; level++) {
+    int shift = BITS * (level + 1);
+    if ((timer.deadline >> shift) == (m_now >> shift)) {
+      m_slots[level][(timer.deadline >> (BITS * level)) & (SLOTS - 1)].push_back (timer);
+      m_counts[level]++;
+      return;
+    }
+  }
+  m_overflow.push_back (timer);
+}
+
+void AmbientTimingWheel::schedule (time_t deadline, uint64_t key)
+{
+  expiry_t timer = { deadline, key };
+  place (timer);
+  m_size++;
+}
+
+void AmbientTimingWheel::tick (time_t now, std::vector<expiry_t> &expired)
+{
+  m_now = now;
+  if ((now & ((time_t (1) << (BITS * LEVELS)) - 1)) == 0) {
+    std::vector<expiry_t> overflow;
+    overflow.swap (m_overflow);
+    for (auto &timer : overflow)
+      place (timer);
+  }
+  //  cascade from the top, timers go down to the level matching m_now
+  for (int level = LEVELS - 1; level > 0; level--) {
+    if ((now & ((time_t (1) << (BITS * level)) - 1)) != 0)
+      continue;
+    std::vector<expiry_t> slot;
+    slot.swap (m_slots[level][(now >> (BITS * level)) & (SLOTS - 1)]);
+    m_counts[level] -= slot.size ();
+    for (auto &timer : slot)
+      place (timer);
+  }
+  std::vector<expiry_t> &slot = m_slots[0][now & (SLOTS - 1)];
+  m_counts[0] -= slot.size ();
+  expired.insert (expired.end (), slot.begin (), slot.end ());
+  m_size -= slot.size ();
+  slot.clear ();
+}
+
+void AmbientTimingWheel::advance (time_t now, std::vector<expiry_t> &expired)
+{
+  while (m_now < now) {
+    //  nothing can fire before the boundary of the first non empty level
+    int empty = 0;
+    while (empty < LEVELS && m_counts[empty] == 0)
+      empty++;
+    if (empty == LEVELS && m_overflow.empty ()) {
+      m_now = now;
+      break;
+    }
+    time_t step = time_t (1) << (BITS * empty);
+    time_t next = (m_now / step + 1) * step;
+    if (next > now) {
+      m_now = now;
+      break;
+    }
+    tick (next, expired);
+  }
+  expired.insert (expired.end (), m_due.begin (), m_due.end ());
+  m_size -= m_due.size ();
+  m_due.clear ();
+}
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+void
+fty_ambient_location_wheel_test (bool verbose)
+{
+    printf (" * fty_ambient_location_wheel: ");
+
+    //  @selftest
+    const time_t start = 1600000000;
+    {
+        AmbientTimingWheel wheel (start);
+        std::vector<AmbientTimingWheel::expiry_t> expired;
+        wheel.schedule (start + 10, 1);
+        wheel.schedule (start + 100, 2);
+        wheel.schedule (start + 5000, 3);
+        wheel.schedule (start - 3, 4);
+        assert (wheel.size () == 4);
+
+        //  already past, fires on next advance
+        wheel.advance (start, expired);
+        assert (expired.size () == 1 && expired[0].key == 4);
+        expired.clear ();
+
+        wheel.advance (start + 9, expired);
+        assert (expired.empty ());
+        wheel.advance (start + 10, expired);
+        assert (expired.size () == 1 && expired[0].key == 1 && expired[0].deadline == start + 10);
+        expired.clear ();
+
+        //  a long step fires everything reached, in deadline order
+        wheel.advance (start + 6000, expired);
+        assert (expired.size () == 2 && expired[0].key == 2 && expired[1].key == 3);
+        assert (wheel.size () == 0);
+        assert (wheel.now () == start + 6000);
+    }
+
+    //  compare with a plain list, including timers beyond the last level
+    {
+        AmbientTimingWheel wheel (start);
+        std::vector<AmbientTimingWheel::expiry_t> pending;
+        uint32_t seed = 42;
+        auto next_random = [&seed] () {
+            seed = seed * 1103515245 + 12345;
+            return (seed >> 8) & 0xffffff;
+        };
+        time_t now = start;
+        for (int round = 0; round < 2000; round++) {
+            for (int i = 0; i < 5; i++) {
+                uint32_t r = next_random ();
+                time_t delay = r % 4 == 0 ? time_t (r) * 16 : r % 600;
+                AmbientTimingWheel::expiry_t timer = { now + delay, uint64_t (round * 5 + i) };
+                wheel.schedule (timer.deadline, timer.key);
+                pending.push_back (timer);
+            }
+            now += next_random () % (round % 100 == 0 ? 100000000 : 300);
+            std::vector<AmbientTimingWheel::expiry_t> expired;
+            wheel.advance (now, expired);
+            std::vector<uint64_t> fired, expected;
+            for (auto &timer : expired) {
+                assert (timer.deadline <= now);
+                fired.push_back (timer.key);
+            }
+            auto it = std::partition (pending.begin (), pending.end (),
+                [now] (const AmbientTimingWheel::expiry_t &timer) { return timer.deadline > now; });
+            for (auto e = it; e != pending.end (); e++)
+                expected.push_back (e->key);
+            pending.erase (it, pending.end ());
+            std::sort (fired.begin (), fired.end ());
+            std::sort (expected.begin (), expected.end ());
+            assert (fired == expected);
+            assert (wheel.size () == pending.size ());
+        }
+    }
+    //  @end
+    printf ("OK\n");
+}
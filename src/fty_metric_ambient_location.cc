@@ -23,14 +23,134 @@
 @header
     fty_metric_ambient_location - Metrics calculator
 @discuss
+    With --record, the stream messages consumed are also written to a file.
+    With --replay, such a file is fed to the server instead of the broker,
+    on virtual time: the calculations run every --interval seconds of the
+    recorded timeline whatever the replay speed, so the averages published
+    are the same at any speed. They are written in a temporary fty-shm
+    directory and printed, sorted, on stdout; throughput on stderr.
 @end
 */
 
 #include "fty_metric_ambient_location_classes.h"
+#include <algorithm>
+#include <cinttypes>
+#include <string>
+#include <vector>
+
+#define DEFAULT_CONFIG_PATH "/etc/fty-metric-ambient-location/fty-metric-ambient-location.cfg"
+
+//  Run one calculation of the replay, return the averages it wrote
+static int64_t
+s_tick (zactor_t *server, int interval)
+{
+    zstr_sendx (server, "TICK", std::to_string (interval).c_str (), NULL);
+    zmsg_t *report = zmsg_recv (server);
+    char *command = report ? zmsg_popstr (report) : NULL;
+    int64_t written = 0;
+    if (command && streq (command, "CYCLE")) {
+        char *duration = zmsg_popstr (report);
+        char *count = zmsg_popstr (report);
+        written = count ? atoll (count) : 0;
+        zstr_free (&duration);
+        zstr_free (&count);
+    }
+    zstr_free (&command);
+    zmsg_destroy (&report);
+    return written;
+}
+
+//  Feed a recording to the server, speed 0 as fast as possible
+static int
+s_replay (const char *config_path, const char *path, double speed, int interval)
+{
+    AmbientRecording recording;
+    if (recording.open (path) != 0)
+        return 1;
+    int64_t time;
+    std::string stream;
+    zmsg_t *msg = NULL;
+    int rv = recording.read (time, stream, &msg);
+    if (rv != 1) {
+        log_error ("%s: no record", path);
+        return 1;
+    }
+
+    char shm_dir[] = "/tmp/fty-metric-ambient-location-replay-XXXXXX";
+    if (!mkdtemp (shm_dir)) {
+        log_error ("Cannot create a temporary directory");
+        zmsg_destroy (&msg);
+        return 1;
+    }
+    fty_shm_set_test_dir (shm_dir);
+    if (interval <= 0)
+        interval = fty_get_polling_interval ();
+
+    zactor_t *server = zactor_new (fty_ambient_location_server, NULL);
+    zstr_sendx (server, "CONFIG", config_path, NULL);
+    time_t next_tick = time_t (time / 1000) + interval;
+    zstr_sendx (server, "SIMULATE", std::to_string (time / 1000).c_str (), std::to_string (interval).c_str (), NULL);
+    zstr_sendx (server, "START", NULL);
+
+    int64_t first = time;
+    int64_t last = time;
+    int64_t start = zclock_mono ();
+    uint64_t records = 0;
+    uint64_t cycles = 0;
+    int64_t written = 0;
+    while (rv == 1 && !zsys_interrupted) {
+        //  calculations due before this record
+        for (; next_tick <= time / 1000; next_tick += interval, cycles++)
+            written += s_tick (server, interval);
+        if (speed > 0) {
+            int64_t due = start + int64_t ((time - first) / speed);
+            if (due > zclock_mono ())
+                zclock_sleep (int (due - zclock_mono ()));
+        }
+        zmsg_pushstr (msg, stream.c_str ());
+        zmsg_pushstr (msg, "STREAM");
+        zmsg_send (&msg, server);
+        records++;
+        last = time;
+        rv = recording.read (time, stream, &msg);
+    }
+    if (rv == -1)
+        log_error ("%s: truncated after %" PRIu64 " records", path, records);
+    //  last calculation, with everything replayed
+    written += s_tick (server, interval);
+    cycles++;
+    double elapsed = (zclock_mono () - start) / 1e3;
+
+    fprintf (stderr, "replayed            %" PRIu64 " messages, %.1f s recorded in %.3f s\n",
+        records, (last - first) / 1e3, elapsed);
+    fprintf (stderr, "throughput          %.0f msg/s\n", records / std::max (elapsed, 1e-3));
+    fprintf (stderr, "calculations        %" PRIu64 " (every %d s), %" PRId64 " averages written\n", cycles, interval, written);
+
+    //  last value of every average, for diffing
+    fty::shm::shmMetrics result;
+    fty::shm::read_metrics (".*", "average\\..*", result);
+    std::vector<std::string> lines;
+    for (fty_proto_t *metric : result)
+        lines.push_back (std::string (fty_proto_type (metric)) + "@" + fty_proto_name (metric) + " "
+            + fty_proto_value (metric) + " " + fty_proto_unit (metric));
+    std::sort (lines.begin (), lines.end ());
+    for (const std::string &line : lines)
+        puts (line.c_str ());
+
+    zactor_destroy (&server);
+    fty_shm_delete_test_dir ();
+    rmdir (shm_dir);
+    return rv == -1 ? 1 : 0;
+}
 
 int main (int argc, char *argv [])
 {
     bool verbose = false;
+    const char *config_path = DEFAULT_CONFIG_PATH;
+    const char *record_path = NULL;
+    const char *replay_path = NULL;
+    double speed = 0;
+    int interval = 0;
     ftylog_setInstance("fty-metric-ambient-location", FTY_COMMON_LOGGING_DEFAULT_CFG);
     int argn;
     for (argn = 1; argn < argc; argn++) {
@@ -38,6 +158,11 @@ int main (int argc, char *argv [])
         ||  streq (argv [argn], "-h")) {
             puts ("fty-metric-ambient-location [options] ...");
             puts ("  --verbose / -v         verbose test output");
+            puts ("  --config / -c [path]   config file (default " DEFAULT_CONFIG_PATH ")");
+            puts ("  --record [path]        also write the stream messages consumed to path");
+            puts ("  --replay [path]        feed a recording instead of the broker, print the averages");
+            puts ("  --speed [x]            replay speed, 1 as recorded, 0 as fast as possible (default 0)");
+            puts ("  --interval [s]         seconds between calculations of the replay (default polling interval)");
             puts ("  --help / -h            this information");
             return 0;
         }
@@ -45,6 +170,35 @@ int main (int argc, char *argv [])
         if (streq (argv [argn], "--verbose")
         ||  streq (argv [argn], "-v"))
             verbose = true;
+        else
+        if (streq (argv [argn], "--config")
+        ||  streq (argv [argn], "-c")) {
+            if (++argn >= argc) {
+                printf ("--config needs an argument\n");
+                return 1;
+            }
+            config_path = argv [argn];
+        }
+        else
+        if (streq (argv [argn], "--record")
+        ||  streq (argv [argn], "--replay")
+        ||  streq (argv [argn], "--speed")
+        ||  streq (argv [argn], "--interval")) {
+            if (++argn >= argc) {
+                printf ("%s needs an argument\n", argv [argn - 1]);
+                return 1;
+            }
+            if (streq (argv [argn - 1], "--record"))
+                record_path = argv [argn];
+            else
+            if (streq (argv [argn - 1], "--replay"))
+                replay_path = argv [argn];
+            else
+            if (streq (argv [argn - 1], "--speed"))
+                speed = atof (argv [argn]);
+            else
+                interval = atoi (argv [argn]);
+        }
         else {
             printf ("Unknown option: %s\n", argv [argn]);
             return 1;
@@ -56,10 +210,16 @@ int main (int argc, char *argv [])
         ftylog_setVeboseMode(ftylog_getInstance());
     }
 
+    if (replay_path)
+        return s_replay (config_path, replay_path, speed, interval);
+
     log_info ("fty_metric_ambient_location - starting...");
 
     zactor_t *server = zactor_new (fty_ambient_location_server, NULL);
 
+    zstr_sendx (server, "CONFIG", config_path, NULL);
+    if (record_path)
+        zstr_sendx (server, "RECORD", record_path, NULL);
     zstr_sendx (server, "CONNECT", "ipc://@/malamute", "fty-metric-ambient-location", NULL);
     zstr_sendx (server, "CONSUMER", FTY_PROTO_STREAM_METRICS_SENSOR, ".*", NULL);
     zstr_sendx (server, "CONSUMER", FTY_PROTO_STREAM_ASSETS, ".*", NULL);
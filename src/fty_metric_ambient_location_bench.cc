@@ -0,0 +1,647 @@
+/*  =========================================================================
+    fty_metric_ambient_location_bench - Ambient location benchmark
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+/*
+@header
+    fty_metric_ambient_location_bench - Ambient location benchmark
+@discuss
+    Builds a synthetic site (datacenters x rooms x rows x racks, with input
+    and output sensors in each rack), streams its assets and then sensor
+    metrics through an in-process Malamute broker to the server, and
+    reports:
+      * ingest rate of the asset and metric messages, up to the point the
+        server has handled the last one;
+      * latency percentiles of the calculation and averages written in
+        shared memory per cycle, while a share of the sensors keeps
+        sending new values;
+      * peak RSS of the process (broker and producers included).
+    With --simulate, calculations run on virtual time instead, one per
+    --interval seconds, as fast as the server goes: --cycles 1440
+    --interval 60 runs a day of sensor traffic.
+    With --shm, sensor metrics are written in shared memory and read there
+    by the server (ingest/backend shm) instead of going through the broker:
+    the ingest rate is then the one of a value of each sensor.
+    Averages are written in a temporary fty-shm test directory.
+
+    With --micro, runs instead the micro benchmarks of the server internals
+    (calculation, stream decoding, asset churn, shared memory writes) and
+    reports time and heap allocations per operation, as JSON with --json.
+    Allocations are counted by wrapping every allocation entry point of
+    glibc (malloc, calloc, realloc and the aligned ones). Elsewhere only
+    operator new is wrapped: malloc and aligned allocations of C code are
+    then left out of the count.
+@end
+*/
+
+#include "fty_metric_ambient_location_classes.h"
+#include <sys/resource.h>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cinttypes>
+#include <new>
+#include <string>
+#include <vector>
+
+#define BENCH_ENDPOINT "inproc://fty-metric-ambient-location-bench"
+#define BENCH_MARKER_DATACENTER "bench-marker-datacenter"
+#define BENCH_MARKER "bench-marker"
+#define BENCH_TTL 300
+#define BENCH_AGENT "fty-metric-ambient-location"
+//  ms between two reads of the sensor metrics in shm (--shm)
+#define BENCH_INGEST_INTERVAL 100
+
+struct bench_options_t {
+    int datacenters = 1;
+    int rooms = 4;
+    int rows = 4;
+    int racks = 10;
+    int sensors_in = 1;
+    int sensors_out = 1;
+    int metrics = 100000;
+    int cycles = 10;
+    int updates = -1;       // metrics sent per cycle, default 10% of sensors
+    int threads = 1;
+    int interval = 1;
+    bool simulate = false;
+    bool shm = false;
+};
+
+//  Heap allocations of the process, for the micro benchmarks
+static std::atomic<uint64_t> s_allocations (0);
+
+#if defined (__GLIBC__)
+extern "C" {
+extern void *__libc_malloc (size_t size);
+extern void *__libc_calloc (size_t count, size_t size);
+extern void *__libc_realloc (void *ptr, size_t size);
+extern void *__libc_memalign (size_t alignment, size_t size);
+extern void *__libc_valloc (size_t size);
+extern void *__libc_pvalloc (size_t size);
+extern void __libc_free (void *ptr);
+
+void *malloc (size_t size) __THROW
+{
+    s_allocations.fetch_add (1, std::memory_order_relaxed);
+    return __libc_malloc (size);
+}
+
+void *calloc (size_t count, size_t size) __THROW
+{
+    s_allocations.fetch_add (1, std::memory_order_relaxed);
+    return __libc_calloc (count, size);
+}
+
+void *realloc (void *ptr, size_t size) __THROW
+{
+    s_allocations.fetch_add (1, std::memory_order_relaxed);
+    return __libc_realloc (ptr, size);
+}
+
+//  aligned ones, behind posix_memalign in libstdc++ or zmq for instance
+void *memalign (size_t alignment, size_t size) __THROW
+{
+    s_allocations.fetch_add (1, std::memory_order_relaxed);
+    return __libc_memalign (alignment, size);
+}
+
+void *aligned_alloc (size_t alignment, size_t size) __THROW
+{
+    s_allocations.fetch_add (1, std::memory_order_relaxed);
+    return __libc_memalign (alignment, size);
+}
+
+int posix_memalign (void **ptr, size_t alignment, size_t size) __THROW
+{
+    if (alignment % sizeof (void *) != 0 || (alignment & (alignment - 1)) != 0)
+        return EINVAL;
+    s_allocations.fetch_add (1, std::memory_order_relaxed);
+    void *allocated = __libc_memalign (alignment, size);
+    if (!allocated)
+        return ENOMEM;
+    *ptr = allocated;
+    return 0;
+}
+
+void *valloc (size_t size) __THROW
+{
+    s_allocations.fetch_add (1, std::memory_order_relaxed);
+    return __libc_valloc (size);
+}
+
+void *pvalloc (size_t size) __THROW
+{
+    s_allocations.fetch_add (1, std::memory_order_relaxed);
+    return __libc_pvalloc (size);
+}
+
+void free (void *ptr) __THROW
+{
+    __libc_free (ptr);
+}
+}
+#else
+void *operator new (size_t size)
+{
+    s_allocations.fetch_add (1, std::memory_order_relaxed);
+    void *ptr = malloc (size ? size : 1);
+    if (!ptr)
+        throw std::bad_alloc ();
+    return ptr;
+}
+
+void operator delete (void *ptr) noexcept
+{
+    free (ptr);
+}
+#endif
+
+static zmsg_t *
+s_asset (const std::string &name, const char *type, const char *subtype, const std::string &parent, const char *function)
+{
+    zhash_t *aux = zhash_new ();
+    zhash_autofree (aux);
+    zhash_insert (aux, "status", (void *) "active");
+    zhash_insert (aux, "type", (void *) type);
+    zhash_insert (aux, "subtype", (void *) subtype);
+    zhash_t *ext = NULL;
+    if (function) {
+        ext = zhash_new ();
+        zhash_autofree (ext);
+        zhash_insert (ext, "logical_asset", (void *) parent.c_str ());
+        zhash_insert (ext, "sensor_function", (void *) function);
+    }
+    else
+    if (!parent.empty ())
+        zhash_insert (aux, "parent_name.1", (void *) parent.c_str ());
+
+    zmsg_t *msg = fty_proto_encode_asset (aux, name.c_str (), FTY_PROTO_ASSET_OP_CREATE, ext);
+    zhash_destroy (&aux);
+    zhash_destroy (&ext);
+    return msg;
+}
+
+static void
+s_send_asset (mlm_client_t *producer, zmsg_t *msg)
+{
+    int rv = mlm_client_send (producer, "ASSET_MANIPULATION", &msg);
+    assert (rv == 0);
+}
+
+static void
+s_send_metric (mlm_client_t *producer, const std::string &sensor, bool temperature, double value, time_t time = 0)
+{
+    zhash_t *aux = zhash_new ();
+    zhash_autofree (aux);
+    zhash_insert (aux, "sname", (void *) sensor.c_str ());
+    const char *type = temperature ? "temperature.0" : "humidity.0";
+    std::string value_s = std::to_string (value);
+    zmsg_t *msg = fty_proto_encode_metric (aux, time ? time : ::time (NULL), BENCH_TTL, type, sensor.c_str (),
+        value_s.c_str (), temperature ? "C" : "%");
+    zhash_destroy (&aux);
+    std::string subject = std::string (type) + "@" + sensor;
+    int rv = mlm_client_send (producer, subject.c_str (), &msg);
+    assert (rv == 0);
+}
+
+//  Write the metric in shm, where the server reads it (--shm)
+static void
+s_write_metric (const std::string &sensor, bool temperature, double value, time_t time = 0)
+{
+    fty_proto_t *metric = fty_proto_new (FTY_PROTO_METRIC);
+    fty_proto_set_name (metric, "%s", sensor.c_str ());
+    fty_proto_set_type (metric, "%s", temperature ? "temperature.0" : "humidity.0");
+    fty_proto_set_value (metric, "%s", std::to_string (value).c_str ());
+    fty_proto_set_unit (metric, "%s", temperature ? "C" : "%");
+    fty_proto_set_ttl (metric, BENCH_TTL);
+    fty_proto_set_time (metric, time ? time : ::time (NULL));
+    int rv = fty::shm::write_metric (metric);
+    assert (rv == 0);
+    fty_proto_destroy (&metric);
+}
+
+//  Return the sensors of the site, after streaming all its assets
+static std::vector<std::string>
+s_send_site (mlm_client_t *producer, const bench_options_t &options)
+{
+    std::vector<std::string> sensors;
+    for (int d = 0; d < options.datacenters; d++) {
+        std::string datacenter = "datacenter-" + std::to_string (d);
+        s_send_asset (producer, s_asset (datacenter, "datacenter", "N_A", "", NULL));
+        for (int m = 0; m < options.rooms; m++) {
+            std::string room = "room-" + std::to_string (d) + "-" + std::to_string (m);
+            s_send_asset (producer, s_asset (room, "room", "N_A", datacenter, NULL));
+            for (int w = 0; w < options.rows; w++) {
+                std::string row = "row-" + std::to_string (d) + "-" + std::to_string (m) + "-" + std::to_string (w);
+                s_send_asset (producer, s_asset (row, "row", "N_A", room, NULL));
+                for (int k = 0; k < options.racks; k++) {
+                    std::string rack = "rack-" + std::to_string (d) + "-" + std::to_string (m) + "-"
+                        + std::to_string (w) + "-" + std::to_string (k);
+                    s_send_asset (producer, s_asset (rack, "rack", "N_A", row, NULL));
+                    for (int s = 0; s < options.sensors_in + options.sensors_out; s++) {
+                        std::string sensor = "sensor-" + std::to_string (sensors.size ());
+                        s_send_asset (producer, s_asset (sensor, "device", "sensor", rack,
+                            s < options.sensors_in ? "input" : "output"));
+                        sensors.push_back (sensor);
+                    }
+                }
+            }
+        }
+    }
+    return sensors;
+}
+
+//  Wait until the server published value for the marker sensor, meaning it
+//  handled everything sent before. Return false on timeout.
+static bool
+s_wait_marker (mlm_client_t *producer_m, double value, int timeout_ms, time_t time = 0)
+{
+    char expected[32];
+    snprintf (expected, sizeof (expected), "%.2f", value);
+    int64_t deadline = zclock_mono () + timeout_ms;
+    int64_t resend = 0;
+    while (zclock_mono () < deadline && !zsys_interrupted) {
+        //  the marker asset may not be known yet, send again from time to time
+        if (zclock_mono () >= resend) {
+            s_send_metric (producer_m, BENCH_MARKER, true, value, time);
+            resend = zclock_mono () + 100;
+        }
+        fty::shm::shmMetrics result;
+        fty::shm::read_metrics (BENCH_MARKER, "temperature.default", result);
+        if (result.size () > 0 && streq (fty_proto_value (result.get (0)), expected))
+            return true;
+        zclock_sleep (1);
+    }
+    return false;
+}
+
+//  Wait until the statistic name of the server reaches target, asked on its
+//  mailbox: with --shm no metric goes through the stream to mark the end of
+//  a phase. Return false on timeout.
+static bool
+s_wait_stat (mlm_client_t *client, const char *name, uint64_t target, int timeout_ms)
+{
+    int64_t deadline = zclock_mono () + timeout_ms;
+    zpoller_t *poller = zpoller_new (mlm_client_msgpipe (client), NULL);
+    bool reached = false;
+    while (!reached && zclock_mono () < deadline && !zsys_interrupted) {
+        zmsg_t *request = zmsg_new ();
+        if (mlm_client_sendto (client, BENCH_AGENT, "STATS", NULL, 1000, &request) != 0)
+            break;
+        if (!zpoller_wait (poller, int (std::max<int64_t> (0, deadline - zclock_mono ()))))
+            break;
+        zmsg_t *reply = mlm_client_recv (client);
+        char *status = zmsg_popstr (reply);
+        while (status && streq (status, "OK") && zmsg_size (reply) >= 2) {
+            char *stat = zmsg_popstr (reply);
+            char *value = zmsg_popstr (reply);
+            if (streq (stat, name))
+                reached = strtoull (value, NULL, 10) >= target;
+            zstr_free (&stat);
+            zstr_free (&value);
+        }
+        zstr_free (&status);
+        zmsg_destroy (&reply);
+        if (!reached)
+            zclock_sleep (10);
+    }
+    zpoller_destroy (&poller);
+    return reached;
+}
+
+static double
+s_percentile (const std::vector<int64_t> &sorted, double percent)
+{
+    if (sorted.empty ())
+        return 0;
+    size_t index = size_t (percent / 100 * (sorted.size () - 1) + 0.5);
+    return double (sorted[index]);
+}
+
+static int
+s_option (int argc, char *argv [], int &argn, int &value)
+{
+    if (++argn >= argc) {
+        printf ("%s needs an argument\n", argv [argn - 1]);
+        return -1;
+    }
+    value = atoi (argv [argn]);
+    return 0;
+}
+
+//  Run the micro benchmarks, shared memory writes go in a tmpfs directory
+static int
+s_micro (bool json)
+{
+    char shm_dir[] = "/dev/shm/fty-metric-ambient-location-bench-XXXXXX";
+    char tmp_dir[] = "/tmp/fty-metric-ambient-location-bench-XXXXXX";
+    char *dir = mkdtemp (shm_dir);
+    if (!dir)
+        dir = mkdtemp (tmp_dir);
+    if (!dir) {
+        log_error ("Cannot create a temporary directory");
+        return 1;
+    }
+    fty_shm_set_test_dir (dir);
+
+    std::vector<ambient_microbench_t> results = fty_ambient_location_server_microbench (&s_allocations);
+
+    if (json) {
+        printf ("[\n");
+        for (size_t i = 0; i < results.size (); i++)
+            printf ("  {\"name\": \"%s\", \"operations\": %" PRIu64 ", \"ns_per_op\": %.1f, \"allocations_per_op\": %.2f}%s\n",
+                results[i].name.c_str (), results[i].operations, results[i].ns_per_op,
+                results[i].allocations_per_op, i + 1 < results.size () ? "," : "");
+        printf ("]\n");
+    }
+    else {
+        for (const auto &result : results)
+            printf ("%-28s %12.1f ns/op %10.2f allocs/op (%" PRIu64 " ops)\n",
+                result.name.c_str (), result.ns_per_op, result.allocations_per_op, result.operations);
+    }
+    fty_shm_delete_test_dir ();
+    rmdir (dir);
+    return 0;
+}
+
+int main (int argc, char *argv [])
+{
+    bench_options_t options;
+    bool verbose = false;
+    bool micro = false;
+    bool json = false;
+    ftylog_setInstance ("fty-metric-ambient-location-bench", "");
+    int argn;
+    for (argn = 1; argn < argc; argn++) {
+        int rv = 0;
+        if (streq (argv [argn], "--help")
+        ||  streq (argv [argn], "-h")) {
+            puts ("fty-metric-ambient-location-bench [options] ...");
+            puts ("  --datacenters N        datacenters (default 1)");
+            puts ("  --rooms N              rooms per datacenter (default 4)");
+            puts ("  --rows N               rows per room (default 4)");
+            puts ("  --racks N              racks per row (default 10)");
+            puts ("  --sensors-in N         input sensors per rack (default 1)");
+            puts ("  --sensors-out N        output sensors per rack (default 1)");
+            puts ("  --metrics N            metrics streamed to measure ingest (default 100000)");
+            puts ("  --cycles N             calculations measured (default 10)");
+            puts ("  --updates N            metrics sent before each calculation (default 10% of sensors)");
+            puts ("  --threads N            calculation threads (default 1)");
+            puts ("  --interval N           seconds between calculations (default 1)");
+            puts ("  --simulate             calculations on virtual time, without waiting");
+            puts ("  --shm                  sensor metrics read by the server in shm instead of the stream");
+            puts ("  --micro                run the micro benchmarks of the internals instead");
+            puts ("  --json                 micro benchmark results as JSON");
+            puts ("  --verbose / -v         verbose output");
+            puts ("  --help / -h            this information");
+            return 0;
+        }
+        else
+        if (streq (argv [argn], "--verbose")
+        ||  streq (argv [argn], "-v"))
+            verbose = true;
+        else
+        if (streq (argv [argn], "--simulate"))
+            options.simulate = true;
+        else
+        if (streq (argv [argn], "--shm"))
+            options.shm = true;
+        else
+        if (streq (argv [argn], "--micro"))
+            micro = true;
+        else
+        if (streq (argv [argn], "--json"))
+            json = true;
+        else
+        if (streq (argv [argn], "--datacenters"))
+            rv = s_option (argc, argv, argn, options.datacenters);
+        else
+        if (streq (argv [argn], "--rooms"))
+            rv = s_option (argc, argv, argn, options.rooms);
+        else
+        if (streq (argv [argn], "--rows"))
+            rv = s_option (argc, argv, argn, options.rows);
+        else
+        if (streq (argv [argn], "--racks"))
+            rv = s_option (argc, argv, argn, options.racks);
+        else
+        if (streq (argv [argn], "--sensors-in"))
+            rv = s_option (argc, argv, argn, options.sensors_in);
+        else
+        if (streq (argv [argn], "--sensors-out"))
+            rv = s_option (argc, argv, argn, options.sensors_out);
+        else
+        if (streq (argv [argn], "--metrics"))
+            rv = s_option (argc, argv, argn, options.metrics);
+        else
+        if (streq (argv [argn], "--cycles"))
+            rv = s_option (argc, argv, argn, options.cycles);
+        else
+        if (streq (argv [argn], "--updates"))
+            rv = s_option (argc, argv, argn, options.updates);
+        else
+        if (streq (argv [argn], "--threads"))
+            rv = s_option (argc, argv, argn, options.threads);
+        else
+        if (streq (argv [argn], "--interval"))
+            rv = s_option (argc, argv, argn, options.interval);
+        else {
+            printf ("Unknown option: %s\n", argv [argn]);
+            return 1;
+        }
+        if (rv != 0)
+            return 1;
+    }
+    if (verbose)
+        ftylog_setVeboseMode (ftylog_getInstance ());
+    if (micro)
+        return s_micro (json);
+
+    char shm_dir[] = "/tmp/fty-metric-ambient-location-bench-XXXXXX";
+    if (!mkdtemp (shm_dir)) {
+        log_error ("Cannot create a temporary directory");
+        return 1;
+    }
+    fty_shm_set_test_dir (shm_dir);
+    fty_shm_set_default_polling_interval (options.interval);
+
+    std::string config_path = std::string (shm_dir) + ".cfg";
+    zconfig_t *config = zconfig_new ("root", NULL);
+    zconfig_put (config, "calculation/threads", std::to_string (options.threads).c_str ());
+    if (options.shm) {
+        zconfig_put (config, "ingest/backend", "shm");
+        zconfig_put (config, "ingest/interval", std::to_string (BENCH_INGEST_INTERVAL).c_str ());
+    }
+    zconfig_save (config, config_path.c_str ());
+    zconfig_destroy (&config);
+
+    zactor_t *broker = zactor_new (mlm_server, (void *) "Malamute");
+    zstr_sendx (broker, "BIND", BENCH_ENDPOINT, NULL);
+
+    zactor_t *server = zactor_new (fty_ambient_location_server, NULL);
+    zstr_sendx (server, "CONFIG", config_path.c_str (), NULL);
+    zstr_sendx (server, "CONNECT", BENCH_ENDPOINT, BENCH_AGENT, NULL);
+    zstr_sendx (server, "CONSUMER", FTY_PROTO_STREAM_METRICS_SENSOR, ".*", NULL);
+    zstr_sendx (server, "CONSUMER", FTY_PROTO_STREAM_ASSETS, ".*", NULL);
+    zstr_sendx (server, "MONITOR", NULL);
+    time_t virtual_time = ::time (NULL);
+    if (options.simulate)
+        zstr_sendx (server, "SIMULATE", std::to_string (virtual_time).c_str (),
+            std::to_string (options.interval).c_str (), NULL);
+    zstr_sendx (server, "START", NULL);
+
+    mlm_client_t *producer = mlm_client_new ();
+    mlm_client_connect (producer, BENCH_ENDPOINT, 1000, "bench-assets");
+    mlm_client_set_producer (producer, FTY_PROTO_STREAM_ASSETS);
+    mlm_client_t *producer_m = mlm_client_new ();
+    mlm_client_connect (producer_m, BENCH_ENDPOINT, 1000, "bench-metrics");
+    mlm_client_set_producer (producer_m, FTY_PROTO_STREAM_METRICS_SENSOR);
+    zclock_sleep (500);
+
+    int rv = 0;
+    double marker = 0;
+
+    //  Assets: the site, then the marker sensor
+    int64_t start = zclock_usecs ();
+    std::vector<std::string> sensors = s_send_site (producer, options);
+    s_send_asset (producer, s_asset (BENCH_MARKER_DATACENTER, "datacenter", "N_A", "", NULL));
+    s_send_asset (producer, s_asset (BENCH_MARKER, "device", "sensor", BENCH_MARKER_DATACENTER, "input"));
+    size_t locations = options.datacenters * (1 + options.rooms * (1 + options.rows * (1 + options.racks)));
+    size_t assets = locations + sensors.size ();
+    if (options.shm ? !s_wait_stat (producer, "assets.received", assets + 2, 60000)
+        : !s_wait_marker (producer_m, ++marker, 60000)) {
+        log_error ("Assets were not handled in time");
+        rv = 1;
+    }
+    double assets_s = (zclock_usecs () - start) / 1e6;
+
+    //  Metrics, round robin on sensors and types; in shm, only the last value
+    //  of each sensor is there to be read, so one of each
+    int metrics = options.shm ? int (sensors.size ()) * 2 : options.metrics;
+    start = zclock_usecs ();
+    for (int i = 0; rv == 0 && i < metrics; i++) {
+        if (options.shm)
+            s_write_metric (sensors[(i / 2) % sensors.size ()], i % 2 == 0, 20 + i % 17);
+        else
+            s_send_metric (producer_m, sensors[(i / 2) % sensors.size ()], i % 2 == 0, 20 + i % 17);
+    }
+    if (rv == 0 && (options.shm ? !s_wait_stat (producer, "cache.updates", metrics, 60000)
+        : !s_wait_marker (producer_m, ++marker, 60000))) {
+        log_error ("Metrics were not handled in time");
+        rv = 1;
+    }
+    double metrics_s = (zclock_usecs () - start) / 1e6;
+
+    //  Calculations, each one after a share of the sensors sent new values.
+    //  Reports of the calculations which ran during ingest are dropped, and
+    //  the one which may be running is skipped.
+    int updates = options.updates >= 0 ? options.updates : std::max<int> (1, sensors.size () / 10);
+    zpoller_t *poller = zpoller_new (server, NULL);
+    while (zpoller_wait (poller, 0)) {
+        zmsg_t *msg = zmsg_recv (server);
+        zmsg_destroy (&msg);
+    }
+    std::vector<int64_t> durations;
+    std::vector<int64_t> writes;
+    bool skipped = false;
+    size_t next = 0;
+    while (rv == 0 && (int) durations.size () < options.cycles && !zsys_interrupted) {
+        //  simulation: the metrics must be handled before the calculation,
+        //  the server reads those in shm on TICK
+        if (options.simulate) {
+            if (!options.shm && !s_wait_marker (producer_m, ++marker, 60000, virtual_time)) {
+                log_error ("Metrics were not handled in time");
+                rv = 1;
+                break;
+            }
+            virtual_time += options.interval;
+            zstr_send (server, "TICK");
+        }
+        void *which = zpoller_wait (poller, options.interval * 3000);
+        if (!which) {
+            log_error ("No calculation reported in time");
+            rv = 1;
+            break;
+        }
+        zmsg_t *msg = zmsg_recv (server);
+        char *command = zmsg_popstr (msg);
+        if (command && streq (command, "CYCLE")) {
+            char *duration = zmsg_popstr (msg);
+            char *written = zmsg_popstr (msg);
+            if (skipped) {
+                durations.push_back (atoll (duration));
+                writes.push_back (atoll (written));
+            }
+            skipped = true;
+            zstr_free (&duration);
+            zstr_free (&written);
+            for (int i = 0; i < updates; i++, next++) {
+                if (options.shm)
+                    s_write_metric (sensors[next % sensors.size ()], next % 2 == 0, 20 + (next * 7) % 13,
+                        options.simulate ? virtual_time : 0);
+                else
+                    s_send_metric (producer_m, sensors[next % sensors.size ()], next % 2 == 0, 20 + (next * 7) % 13,
+                        options.simulate ? virtual_time : 0);
+            }
+        }
+        zstr_free (&command);
+        zmsg_destroy (&msg);
+    }
+    zpoller_destroy (&poller);
+
+    struct rusage usage;
+    getrusage (RUSAGE_SELF, &usage);
+
+    if (rv == 0) {
+        std::sort (durations.begin (), durations.end ());
+        double average_writes = 0;
+        for (int64_t w : writes)
+            average_writes += w;
+        average_writes /= std::max<size_t> (1, writes.size ());
+
+        printf ("topology            %d datacenters x %d rooms x %d rows x %d racks x (%d in + %d out) sensors\n",
+            options.datacenters, options.rooms, options.rows, options.racks, options.sensors_in, options.sensors_out);
+        printf ("assets              %zu (%zu locations, %zu sensors)\n", assets, locations, sensors.size ());
+        printf ("threads             %d\n", options.threads);
+        printf ("asset ingest        %.0f msg/s (%.3f s)\n", (assets + 2) / assets_s, assets_s);
+        if (options.shm)
+            printf ("metric ingest       %.0f values/s from shm, read every %d ms (%.3f s)\n", metrics / metrics_s,
+                BENCH_INGEST_INTERVAL, metrics_s);
+        else
+            printf ("metric ingest       %.0f msg/s (%.3f s)\n", (options.metrics + 1) / metrics_s, metrics_s);
+        printf ("calculation         %zu cycles, %d metrics before each%s\n", durations.size (), updates,
+            options.simulate ? ", simulated" : "");
+        printf ("  latency           p50 %.3f ms, p90 %.3f ms, p99 %.3f ms, max %.3f ms\n",
+            s_percentile (durations, 50) / 1e3, s_percentile (durations, 90) / 1e3,
+            s_percentile (durations, 99) / 1e3, s_percentile (durations, 100) / 1e3);
+        printf ("  shm writes        %.1f per cycle\n", average_writes);
+        printf ("peak rss            %ld kB\n", usage.ru_maxrss);
+    }
+
+    zactor_destroy (&server);
+    mlm_client_destroy (&producer);
+    mlm_client_destroy (&producer_m);
+    zactor_destroy (&broker);
+    fty_shm_delete_test_dir ();
+    rmdir (shm_dir);
+    unlink (config_path.c_str ());
+    return rv;
+}
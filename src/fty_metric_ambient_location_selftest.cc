@@ -41,6 +41,15 @@ static test_item_t
 all_tests [] = {
 #ifdef FTY_METRIC_AMBIENT_LOCATION_BUILD_DRAFT_API
 // Tests for draft public classes:
+    { "fty_ambient_location_topology", fty_ambient_location_topology_test, false, true, NULL },
+    { "fty_ambient_location_pool", fty_ambient_location_pool_test, false, true, NULL },
+    { "fty_ambient_location_wheel", fty_ambient_location_wheel_test, false, true, NULL },
+    { "fty_ambient_location_clock", fty_ambient_location_clock_test, false, true, NULL },
+    { "fty_ambient_location_recording", fty_ambient_location_recording_test, false, true, NULL },
+    { "fty_ambient_location_stats", fty_ambient_location_stats_test, false, true, NULL },
+    { "fty_ambient_location_histogram", fty_ambient_location_histogram_test, false, true, NULL },
+    { "fty_ambient_location_store", fty_ambient_location_store_test, false, true, NULL },
+    { "fty_ambient_location_metric", fty_ambient_location_metric_test, false, true, NULL },
     { "fty_ambient_location_server", fty_ambient_location_server_test, false, true, NULL },
 #endif // FTY_METRIC_AMBIENT_LOCATION_BUILD_DRAFT_API
     {NULL, NULL, 0, 0, NULL}          //  Sentinel